@@ -9,6 +9,7 @@
 #include "worker-protocol.hh"
 #include "nar-accessor.hh"
 #include "nar-info-disk-cache.hh"
+#include "thread-pool.hh"
 
 #include <chrono>
 
@@ -20,10 +21,6 @@ BinaryCacheStore::BinaryCacheStore(const StoreParams & params)
     auto secretKeyFile = get(params, "secret-key", "");
     if (secretKeyFile != "")
         secretKey = std::unique_ptr<SecretKey>(new SecretKey(readFile(secretKeyFile)));
-
-    StringSink sink;
-    sink << narVersionMagic1;
-    narMagic = *sink.s;
 }
 
 void BinaryCacheStore::init()
@@ -57,15 +54,28 @@ void BinaryCacheStore::notImpl()
     throw Error("operation not implemented for binary cache stores");
 }
 
+void BinaryCacheStore::getFile(const std::string & path, Sink & sink)
+{
+    auto data = getFile(path);
+    if (!data)
+        throw NoSuchBinaryCacheFile(format("file ‘%s’ does not exist in binary cache ‘%s’") % path % getUri());
+    sink(*data);
+}
+
 Path BinaryCacheStore::narInfoFileFor(const Path & storePath)
 {
     assertStorePath(storePath);
     return storePathToHash(storePath) + ".narinfo";
 }
 
-void BinaryCacheStore::addToStore(const ValidPathInfo & info, const std::string & nar, bool repair)
+void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource, bool repair)
 {
-    if (!repair && isValidPath(info.path)) return;
+    if (!repair && isValidPath(info.path)) {
+        /* Consume the NAR anyway. */
+        ParseSink sink;
+        parseDump(sink, narSource);
+        return;
+    }
 
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
@@ -80,28 +90,49 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const std::string
 
     auto narInfoFile = narInfoFileFor(info.path);
 
-    assert(nar.compare(0, narMagic.size(), narMagic) == 0);
-
     auto narInfo = make_ref<NarInfo>(info);
 
-    narInfo->narSize = nar.size();
-    narInfo->narHash = hashString(htSHA256, nar);
+    /* Compress the NAR while reading it, hashing both the
+       uncompressed and the compressed data along the way. Thus only
+       the compressed NAR is kept in memory. */
+    narInfo->compression = compression;
+    auto now1 = std::chrono::steady_clock::now();
+
+    StringSink narCompressed;
+    HashSink fileHashSink(htSHA256);
+    LambdaSink compressedSink([&](const unsigned char * data, size_t len) {
+        narCompressed(data, len);
+        fileHashSink(data, len);
+    });
+    auto compressionSink = makeCompressionSink(compression, compressedSink);
+
+    HashSink narHashSink(htSHA256);
+    LambdaSink narSink([&](const unsigned char * data, size_t len) {
+        narHashSink(data, len);
+        (*compressionSink)(data, len);
+    });
+
+    TeeSource tee(narSource, narSink);
+    ParseSink parseSink;
+    parseDump(parseSink, tee);
+    compressionSink->finish();
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    auto narHash = narHashSink.finish();
+    narInfo->narHash = narHash.first;
+    narInfo->narSize = narHash.second;
 
     if (info.narHash && info.narHash != narInfo->narHash)
         throw Error(format("refusing to copy corrupted path ‘%1%’ to binary cache") % info.path);
 
-    /* Compress the NAR. */
-    narInfo->compression = compression;
-    auto now1 = std::chrono::steady_clock::now();
-    auto narCompressed = compress(compression, nar);
-    auto now2 = std::chrono::steady_clock::now();
-    narInfo->fileHash = hashString(htSHA256, *narCompressed);
-    narInfo->fileSize = narCompressed->size();
+    narInfo->fileHash = fileHashSink.finish().first;
+    narInfo->fileSize = narCompressed.s->size();
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, format("copying path ‘%1%’ (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache")
         % narInfo->path % narInfo->narSize
-        % ((1.0 - (double) narCompressed->size() / nar.size()) * 100.0)
+        % ((1.0 - (double) narInfo->fileSize / narInfo->narSize) * 100.0)
         % duration);
 
     /* Atomically write the NAR file. */
@@ -111,12 +142,12 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const std::string
            "");
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
-        upsertFile(narInfo->url, *narCompressed);
+        upsertFile(narInfo->url, *narCompressed.s);
     } else
         stats.narWriteAverted++;
 
-    stats.narWriteBytes += nar.size();
-    stats.narWriteCompressedBytes += narCompressed->size();
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += narInfo->fileSize;
     stats.narWriteCompressionTimeMs += duration;
 
     /* Atomically write the NAR info file.*/
@@ -126,10 +157,7 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const std::string
 
     auto hashPart = storePathToHash(narInfo->path);
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(hashPart, std::shared_ptr<NarInfo>(narInfo));
-    }
+    pathInfoCache.upsert(hashPart, std::shared_ptr<NarInfo>(narInfo));
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), hashPart, std::shared_ptr<NarInfo>(narInfo));
@@ -145,33 +173,99 @@ bool BinaryCacheStore::isValidPathUncached(const Path & storePath)
     return fileExists(narInfoFileFor(storePath));
 }
 
-void BinaryCacheStore::narFromPath(const Path & storePath, Sink & sink)
+PathSet BinaryCacheStore::queryValidPaths(const PathSet & paths)
 {
-    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+    PathSet res, todo;
+
+    /* Check the in-memory cache. */
+    for (auto & path : paths) {
+        std::shared_ptr<ValidPathInfo> info;
+        if (pathInfoCache.get(storePathToHash(path), info)) {
+            stats.narInfoReadAverted++;
+            if (info) res.insert(path);
+        } else
+            todo.insert(path);
+    }
+
+    /* Check the disk cache. */
+    if (diskCache && !todo.empty()) {
+        for (auto & i : diskCache->lookupNarExistence(getUri(), todo)) {
+            stats.narInfoReadAverted++;
+            if (i.second) res.insert(i.first);
+            todo.erase(i.first);
+        }
+    }
 
-    auto nar = getFile(info->url);
+    if (todo.empty()) return res;
 
-    if (!nar) throw Error(format("file ‘%s’ missing from binary cache") % info->url);
+    /* Query the remaining paths in parallel. The requests are
+       latency-bound, so use more threads than there are cores. */
+    Sync<std::map<Path, bool>> exists_;
 
-    stats.narRead++;
-    stats.narReadCompressedBytes += nar->size();
+    ThreadPool pool(std::max(1, settings.get("binary-caches-parallel-connections", 25)));
 
-    /* Decompress the NAR. FIXME: would be nice to have the remote
-       side do this. */
+    for (auto & path : todo)
+        pool.enqueue([this, path, &exists_]() {
+            checkInterrupt();
+            bool valid = isValidPathUncached(path);
+            exists_.lock()->emplace(path, valid);
+        });
+
+    pool.process();
+
+    auto exists(exists_.lock());
+
+    for (auto & i : *exists)
+        if (i.second)
+            res.insert(i.first);
+        else
+            pathInfoCache.upsert(storePathToHash(i.first), 0);
+
+    if (diskCache)
+        diskCache->upsertNarExistence(getUri(), *exists);
+
+    return res;
+}
+
+void BinaryCacheStore::narFromPath(const Path & storePath, Sink & sink)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    uint64_t narSize = 0;
+    LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
+        sink(data, len);
+        narSize += len;
+    });
+
+    /* Decompress the NAR while it's being fetched. FIXME: would be
+       nice to have the remote side do this. */
+    std::shared_ptr<CompressionSink> decompressor;
     try {
-        nar = decompress(info->compression, *nar);
+        decompressor = makeDecompressionSink(info->compression, wrapperSink);
     } catch (UnknownCompressionMethod &) {
         throw Error(format("binary cache path ‘%s’ uses unknown compression method ‘%s’")
             % storePath % info->compression);
     }
 
-    stats.narReadBytes += nar->size();
+    uint64_t compressedSize = 0;
+    LambdaSink compressedSink([&](const unsigned char * data, size_t len) {
+        (*decompressor)(data, len);
+        compressedSize += len;
+    });
+
+    try {
+        getFile(info->url, compressedSink);
+    } catch (NoSuchBinaryCacheFile & e) {
+        throw Error(format("file ‘%s’ missing from binary cache") % info->url);
+    }
 
-    printMsg(lvlTalkative, format("exporting path ‘%1%’ (%2% bytes)") % storePath % nar->size());
+    decompressor->finish();
 
-    assert(nar->size() % 8 == 0);
+    stats.narRead++;
+    stats.narReadCompressedBytes += compressedSize;
+    stats.narReadBytes += narSize;
 
-    sink((unsigned char *) nar->c_str(), nar->size());
+    printMsg(lvlTalkative, format("exported path ‘%1%’ (%2% bytes)") % storePath % narSize);
 }
 
 std::shared_ptr<ValidPathInfo> BinaryCacheStore::queryPathInfoUncached(const Path & storePath)
@@ -187,6 +281,28 @@ std::shared_ptr<ValidPathInfo> BinaryCacheStore::queryPathInfoUncached(const Pat
     return std::shared_ptr<NarInfo>(narInfo);
 }
 
+void BinaryCacheStore::queryPathInfosUncached(const PathSet & paths,
+    std::map<Path, std::shared_ptr<ValidPathInfo>> & infos)
+{
+    /* Fetch the NAR info files in parallel, as in
+       queryValidPaths(). */
+    Sync<std::map<Path, std::shared_ptr<ValidPathInfo>>> infos_;
+
+    ThreadPool pool(std::max(1, settings.get("binary-caches-parallel-connections", 25)));
+
+    for (auto & path : paths)
+        pool.enqueue([this, path, &infos_]() {
+            checkInterrupt();
+            auto info = queryPathInfoUncached(path);
+            if (info) infos_.lock()->emplace(path, info);
+        });
+
+    pool.process();
+
+    auto infos2(infos_.lock());
+    infos.insert(infos2->begin(), infos2->end());
+}
+
 Path BinaryCacheStore::addToStore(const string & name, const Path & srcPath,
     bool recursive, HashType hashAlgo, PathFilter & filter, bool repair)
 {
@@ -209,7 +325,8 @@ Path BinaryCacheStore::addToStore(const string & name, const Path & srcPath,
     ValidPathInfo info;
     info.path = makeFixedOutputPath(recursive, hashAlgo, h, name);
 
-    addToStore(info, *sink.s, repair);
+    StringSource source(*sink.s);
+    addToStore(info, source, repair);
 
     return info.path;
 }
@@ -224,7 +341,8 @@ Path BinaryCacheStore::addTextToStore(const string & name, const string & s,
     if (repair || !isValidPath(info.path)) {
         StringSink sink;
         dumpString(s, sink);
-        addToStore(info, *sink.s, repair);
+        StringSource source(*sink.s);
+        addToStore(info, source, repair);
     }
 
     return info.path;
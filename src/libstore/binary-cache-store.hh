@@ -11,6 +11,8 @@ namespace nix {
 
 struct NarInfo;
 
+MakeError(NoSuchBinaryCacheFile, Error);
+
 class BinaryCacheStore : public Store
 {
 private:
@@ -33,6 +35,12 @@ protected:
        doesn't exist. */
     virtual std::shared_ptr<std::string> getFile(const std::string & path) = 0;
 
+    /* Write the contents of the specified file to a sink, or throw
+       NoSuchBinaryCacheFile if it doesn't exist. The default
+       implementation reads the entire file into memory;
+       implementations should override it to stream the data. */
+    virtual void getFile(const std::string & path, Sink & sink);
+
     bool wantMassQuery_ = false;
     int priority = 50;
 
@@ -42,22 +50,22 @@ public:
 
 private:
 
-    std::string narMagic;
-
     std::string narInfoFileFor(const Path & storePath);
 
 public:
 
     bool isValidPathUncached(const Path & path) override;
 
-    PathSet queryValidPaths(const PathSet & paths) override
-    { notImpl(); }
+    PathSet queryValidPaths(const PathSet & paths) override;
 
     PathSet queryAllValidPaths() override
     { notImpl(); }
 
     std::shared_ptr<ValidPathInfo> queryPathInfoUncached(const Path & path) override;
 
+    void queryPathInfosUncached(const PathSet & paths,
+        std::map<Path, std::shared_ptr<ValidPathInfo>> & infos) override;
+
     void queryReferrers(const Path & path,
         PathSet & referrers) override
     { notImpl(); }
@@ -83,7 +91,7 @@ public:
 
     bool wantMassQuery() { return wantMassQuery_; }
 
-    void addToStore(const ValidPathInfo & info, const std::string & nar,
+    void addToStore(const ValidPathInfo & info, Source & narSource,
         bool repair = false) override;
 
     Path addToStore(const string & name, const Path & srcPath,
@@ -123,7 +131,7 @@ public:
     void optimiseStore() override
     { }
 
-    bool verifyStore(bool checkContents, bool repair) override
+    bool verifyStore(bool checkContents, bool repair, bool resume) override
     { return true; }
 
     ref<FSAccessor> getFSAccessor() override;
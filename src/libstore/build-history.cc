@@ -0,0 +1,199 @@
+#include "build-history.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+#include "derivations.hh"
+#include "store-api.hh"
+
+#include <sqlite3.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists Builds (
+    id        integer primary key autoincrement not null,
+    name      text not null,
+    drvPath   text not null,
+    success   integer not null,
+    startTime integer not null,
+    stopTime  integer not null,
+    cpuUser   integer not null,
+    cpuSystem integer not null,
+    peakRSS   integer not null
+);
+
+create index if not exists IndexBuildsName on Builds(name);
+
+)sql";
+
+class BuildHistoryImpl : public BuildHistory
+{
+public:
+
+    /* The number of builds remembered per derivation name. */
+    const int maxBuilds = 20;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertBuild, pruneBuilds, queryBuilds, queryAllBuilds, queryDuration, queryPeakRSS;
+    };
+
+    Sync<State> _state;
+
+    BuildHistoryImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = settings.nixDBPath + "/build-history.sqlite";
+
+        /* Users who can't write to the Nix database can still read
+           the history. If it can't be opened at all, we just don't
+           record anything. */
+        if (sqlite3_open_v2(dbPath.c_str(), &state->db.db,
+                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) != SQLITE_OK)
+        {
+            sqlite3_close(state->db.db);
+            state->db.db = 0;
+            if (sqlite3_open_v2(dbPath.c_str(), &state->db.db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+                sqlite3_close(state->db.db);
+                state->db.db = 0;
+                debug(format("cannot open build history ‘%s’") % dbPath);
+                return;
+            }
+        }
+
+        if (sqlite3_busy_timeout(state->db, 60 * 60 * 1000) != SQLITE_OK)
+            throwSQLiteError(state->db, "setting timeout");
+
+        if (sqlite3_db_readonly(state->db, "main") == 0
+            && sqlite3_exec(state->db, schema, 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(state->db, "initialising database schema");
+
+        state->insertBuild.create(state->db,
+            "insert into Builds(name, drvPath, success, startTime, stopTime, cpuUser, cpuSystem, peakRSS) "
+            "values (?, ?, ?, ?, ?, ?, ?, ?)");
+
+        state->pruneBuilds.create(state->db,
+            "delete from Builds where name = ? and id not in "
+            "(select id from Builds where name = ? order by id desc limit ?)");
+
+        state->queryBuilds.create(state->db,
+            "select name, drvPath, success, startTime, stopTime, cpuUser, cpuSystem, peakRSS "
+            "from Builds where name = ? order by id desc");
+
+        state->queryAllBuilds.create(state->db,
+            "select name, drvPath, success, startTime, stopTime, cpuUser, cpuSystem, peakRSS "
+            "from Builds order by id desc");
+
+        state->queryDuration.create(state->db,
+            "select avg(stopTime - startTime) from Builds where name = ? and success = 1");
+
+        state->queryPeakRSS.create(state->db,
+            "select max(peakRSS) from Builds where name = ?");
+    }
+
+    void addBuild(const BuildRecord & record) override
+    {
+        auto state(_state.lock());
+        if (!state->db || sqlite3_db_readonly(state->db, "main") != 0) return;
+
+        SQLiteTxn txn(state->db);
+
+        state->insertBuild.use()
+            (record.name)
+            (record.drvPath)
+            (record.success ? 1 : 0)
+            (record.startTime)
+            (record.stopTime)
+            (record.cpuUser)
+            (record.cpuSystem)
+            (record.peakRSS)
+            .exec();
+
+        state->pruneBuilds.use()(record.name)(record.name)(maxBuilds).exec();
+
+        txn.commit();
+    }
+
+    std::vector<BuildRecord> queryBuilds(const std::string & name) override
+    {
+        auto state(_state.lock());
+        std::vector<BuildRecord> res;
+        if (!state->db) return res;
+
+        auto readRecords = [&](SQLiteStmt::Use & query) {
+            while (query.next()) {
+                BuildRecord record;
+                record.name = query.getStr(0);
+                record.drvPath = query.getStr(1);
+                record.success = query.getInt(2) != 0;
+                record.startTime = query.getInt(3);
+                record.stopTime = query.getInt(4);
+                record.cpuUser = query.getInt(5);
+                record.cpuSystem = query.getInt(6);
+                record.peakRSS = query.getInt(7);
+                res.push_back(record);
+            }
+        };
+
+        if (name.empty()) {
+            auto query(state->queryAllBuilds.use());
+            readRecords(query);
+        } else {
+            auto query(state->queryBuilds.use()(name));
+            readRecords(query);
+        }
+
+        return res;
+    }
+
+    double estimateDuration(const std::string & name) override
+    {
+        auto state(_state.lock());
+        if (!state->db) return -1;
+
+        auto query(state->queryDuration.use()(name));
+        if (!query.next() || query.isNull(0)) return -1;
+        return sqlite3_column_double(state->queryDuration, 0);
+    }
+
+    uint64_t estimatePeakRSS(const std::string & name) override
+    {
+        auto state(_state.lock());
+        if (!state->db) return 0;
+
+        auto query(state->queryPeakRSS.use()(name));
+        if (!query.next() || query.isNull(0)) return 0;
+        return query.getInt(0);
+    }
+};
+
+
+std::string buildHistoryName(const Path & drvPath)
+{
+    std::string name = storePathToName(drvPath);
+    if (isDerivation(name)) name = std::string(name, 0, name.size() - drvExtension.size());
+
+    /* Strip the version, which starts at the first dash followed by
+       a non-letter (as in DrvName). */
+    for (size_t i = 0; i + 1 < name.size(); ++i)
+        if (name[i] == '-' && !isalpha(name[i + 1]))
+            return std::string(name, 0, i);
+
+    return name;
+}
+
+
+ref<BuildHistory> getBuildHistory()
+{
+    static Sync<std::shared_ptr<BuildHistory>> history;
+
+    auto history_(history.lock());
+    if (!*history_) *history_ = std::make_shared<BuildHistoryImpl>();
+    return ref<BuildHistory>(*history_);
+}
+
+
+}
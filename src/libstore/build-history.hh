@@ -0,0 +1,65 @@
+#pragma once
+
+#include "ref.hh"
+#include "types.hh"
+
+namespace nix {
+
+
+/* A record of a local build of a derivation. */
+struct BuildRecord
+{
+    /* The name of the derivation, without its version (e.g. ‘hello’
+       for ‘hello-2.10’), since that's what builds are compared by. */
+    std::string name;
+
+    Path drvPath;
+
+    bool success = false;
+
+    time_t startTime = 0, stopTime = 0;
+
+    /* User and system CPU time in microseconds. */
+    uint64_t cpuUser = 0, cpuSystem = 0;
+
+    /* Peak resident set size in bytes. */
+    uint64_t peakRSS = 0;
+};
+
+
+/* A database of the time and resources taken by past builds, kept
+   next to the Nix database. */
+class BuildHistory
+{
+public:
+
+    virtual void addBuild(const BuildRecord & record) = 0;
+
+    /* Return the recorded builds of derivations with the given name
+       (as per BuildRecord::name), most recent first. If ‘name’ is
+       empty, return the builds of all derivations. */
+    virtual std::vector<BuildRecord> queryBuilds(const std::string & name) = 0;
+
+    /* Return the average wall time, in seconds, of the recorded
+       successful builds of derivations with the given name, or -1
+       if there are none. */
+    virtual double estimateDuration(const std::string & name) = 0;
+
+    /* Return the highest peak RSS, in bytes, of the recorded builds
+       of derivations with the given name, or 0 if there are none.
+       Failed builds count too, since they may have failed for lack
+       of memory. */
+    virtual uint64_t estimatePeakRSS(const std::string & name) = 0;
+};
+
+
+/* Return the name under which builds of ‘drvPath’ are recorded. */
+std::string buildHistoryName(const Path & drvPath);
+
+
+/* Return a singleton build history object that can be used
+   concurrently by multiple threads. */
+ref<BuildHistory> getBuildHistory();
+
+
+}
@@ -10,6 +10,7 @@
 #include "builtins.hh"
 #include "finally.hh"
 #include "compression.hh"
+#include "build-history.hh"
 
 #include <algorithm>
 #include <iostream>
@@ -25,7 +26,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
-#include <sys/select.h>
 #include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -54,7 +54,10 @@
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/syscall.h>
+#include <sys/epoll.h>
 #define pivot_root(new_root, put_old) (syscall(SYS_pivot_root, new_root, put_old))
+#else
+#include <poll.h>
 #endif
 
 #if HAVE_STATVFS
@@ -99,6 +102,10 @@ class Goal : public std::enable_shared_from_this<Goal>
 public:
     typedef enum {ecBusy, ecSuccess, ecFailed, ecNoSubstituters, ecIncompleteClosure} ExitCode;
 
+    /* The kinds of jobs that have separate limits on the number of
+       concurrent processes. */
+    typedef enum {jcBuild, jcSubstitution} JobCategory;
+
 protected:
 
     /* Backlink to the worker. */
@@ -128,6 +135,21 @@ protected:
     /* Whether the goal is finished. */
     ExitCode exitCode;
 
+    /* The estimated cost of this goal. This is a unit cost unless a
+       subclass knows better. */
+    double cost = 1;
+
+    /* The estimated cost of the most expensive chain of goals that
+       starts with this goal and ends with a top-level goal, following
+       the ‘waiters’ links.  Goals on such a chain can't finish before
+       this one, so goals with a longer critical path are started
+       first. */
+    double criticalPath = 1;
+
+    /* The expected peak memory use of the process run by this goal,
+       in bytes, or 0 if unknown. */
+    uint64_t expectedMemory = 0;
+
     Goal(Worker & worker) : worker(worker)
     {
         nrFailed = nrNoSubstituters = nrIncompleteClosure = 0;
@@ -168,6 +190,22 @@ public:
         return exitCode;
     }
 
+    double getCriticalPath()
+    {
+        return criticalPath;
+    }
+
+    uint64_t getExpectedMemory()
+    {
+        return expectedMemory;
+    }
+
+    /* Return the number of goals waiting for this one. */
+    size_t getNrWaiters()
+    {
+        return waiters.size();
+    }
+
     /* Callback in case of a timeout.  It should wake up its waiters,
        get rid of any running child processes that are being monitored
        by the worker (important!), etc. */
@@ -175,8 +213,14 @@ public:
 
     virtual string key() = 0;
 
+    virtual JobCategory jobCategory() = 0;
+
 protected:
     void amDone(ExitCode result);
+
+    /* Update the critical path of this goal and its waitees after
+       it got a waiter with critical path ‘waiterPath’. */
+    void raiseCriticalPath(double waiterPath);
 };
 
 
@@ -196,8 +240,10 @@ struct Child
     set<int> fds;
     bool respectTimeouts;
     bool inBuildSlot;
+    uint64_t expectedMemory; /* reserved for the child, see Worker::reservedMemory */
     time_t lastOutput; /* time we last got output on stdout/stderr */
     time_t timeStarted;
+    time_t deadline; /* earliest timeout, or LONG_MAX if none */
 };
 
 
@@ -215,16 +261,66 @@ private:
     /* Goals that are ready to do some work. */
     WeakGoals awake;
 
-    /* Goals waiting for a build slot. */
-    WeakGoals wantingToBuild;
+    /* Goals waiting for a build slot, and the number of build slots
+       that each of them may use (see getBuildSlot()). */
+    std::list<std::pair<WeakGoalPtr, unsigned int>> wantingToBuild;
+
+    /* Goals that have been given a build slot, but haven't taken it
+       yet. */
+    Goals granted;
 
     /* Child processes currently running. */
     std::list<Child> children;
 
-    /* Number of build slots occupied.  This includes local builds and
-       substitutions but not remote builds via the build hook. */
+    /* The child to which each file descriptor being monitored
+       belongs. */
+    std::map<int, Child *> childFDs;
+
+    /* The children that are subject to a timeout, ordered by
+       deadline. */
+    std::set<std::pair<time_t, Child *>> deadlines;
+
+#if __linux__
+    /* The epoll instance used to wait for input from children. */
+    AutoCloseFD epollFD;
+#endif
+
+    /* Number of build slots occupied.  This includes local builds but
+       not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
 
+    /* Number of substitution slots occupied. */
+    unsigned int nrSubstitutions;
+
+    /* The amount of memory that must remain available after starting
+       a local build, or 0 if builds are admitted regardless of
+       memory.  Set by the ‘build-min-free-memory’ option. */
+    uint64_t minFreeMemory;
+
+    /* The expected peak memory use of the running local builds,
+       which they may not have reached yet. */
+    uint64_t reservedMemory;
+
+    /* Whether some goals are being held back for lack of memory, in
+       which case we check again every few seconds. */
+    bool waitingForMemory;
+
+    /* The goals held back for lack of memory (by key), and since
+       when. */
+    std::map<string, time_t> delayedBuilds;
+
+    /* The number of builds that were held back for lack of memory,
+       and the total time they were held back. */
+    unsigned int nrDelayedBuilds;
+    time_t totalBuildDelay;
+
+    /* Return the number of occupied slots of the kind used by
+       ‘goal’. */
+    unsigned int & nrRunning(GoalPtr goal)
+    {
+        return goal->jobCategory() == Goal::jcSubstitution ? nrSubstitutions : nrLocalBuilds;
+    }
+
     /* Maps used to prevent multiple instantiations of a goal for the
        same derivation / path. */
     WeakGoalMap derivationGoals;
@@ -270,25 +366,25 @@ public:
     /* Wake up a goal (i.e., there is something for it to do). */
     void wakeUp(GoalPtr goal);
 
-    /* Return the number of local build and substitution processes
-       currently running (but not remote builds via the build
-       hook). */
+    /* Return the number of local build processes currently running
+       (but not remote builds via the build hook). */
     unsigned int getNrLocalBuilds();
 
     /* Registers a running child process.  `inBuildSlot' means that
-       the process counts towards the jobs limit. */
+       the process counts towards the jobs limit (or the substitution
+       jobs limit, if `goal' is a substitution). */
     void childStarted(GoalPtr goal, const set<int> & fds,
         bool inBuildSlot, bool respectTimeouts);
 
-    /* Unregisters a running child process.  `wakeSleepers' should be
-       false if there is no sense in waking up goals that are sleeping
-       because they can't run yet (e.g., there is no free build slot,
-       or the hook would still say `postpone'). */
-    void childTerminated(GoalPtr goal, bool wakeSleepers = true);
+    /* Unregisters a running child process. */
+    void childTerminated(GoalPtr goal);
 
-    /* Put `goal' to sleep until a build slot becomes available (which
-       might be right away). */
-    void waitForBuildSlot(GoalPtr goal);
+    /* Return true if `goal' may start a process that occupies a
+       build slot, given that at most `maxJobs' such processes may
+       run.  Builds and substitutions have separate pools of slots.
+       Otherwise, put `goal' to sleep until a build slot is granted
+       to it.  Slots are granted by grantBuildSlots(). */
+    bool getBuildSlot(GoalPtr goal, unsigned int maxJobs);
 
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
@@ -303,6 +399,15 @@ public:
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
+    /* Wake up the goals waiting for a build slot that can have one,
+       in order of priority.  This is only done when no goal is awake,
+       so that goals that became runnable at the same time compete
+       for the free slots.  If ‘minFreeMemory’ is set, local builds
+       only get a slot if the memory available to new processes
+       exceeds it by their expected memory use and that reserved by
+       other builds.  Return true if any goal was woken up. */
+    bool grantBuildSlots();
+
     /* Wait for input to become available. */
     void waitForInput();
 
@@ -313,6 +418,16 @@ public:
     bool pathContentsGood(const Path & path);
 
     void markContentsGood(const Path & path);
+
+private:
+
+    /* Start or stop monitoring a file descriptor of a child. */
+    void addChildFD(Child & child, int fd);
+    void removeChildFD(int fd);
+
+    /* Recompute the deadline of a child after its last output time
+       has changed. */
+    void updateDeadline(Child & child);
 };
 
 
@@ -333,6 +448,26 @@ void Goal::addWaitee(GoalPtr waitee)
 {
     waitees.insert(waitee);
     addToWeakGoals(waitee->waiters, shared_from_this());
+    waitee->raiseCriticalPath(criticalPath);
+}
+
+
+void Goal::raiseCriticalPath(double waiterPath)
+{
+    /* Goal graphs can be deep, so don't recurse. Critical paths
+       only ever grow, so we can stop at goals that are already on a
+       longer path. */
+    std::vector<std::pair<Goal *, double>> todo{{this, waiterPath}};
+
+    while (!todo.empty()) {
+        auto goal = todo.back().first;
+        auto path = goal->cost + todo.back().second;
+        todo.pop_back();
+        if (path <= goal->criticalPath) continue;
+        goal->criticalPath = path;
+        for (auto & i : goal->waitees)
+            todo.emplace_back(i.get(), path);
+    }
 }
 
 
@@ -826,6 +961,11 @@ public:
         return "b$" + storePathToName(drvPath) + "$" + drvPath;
     }
 
+    JobCategory jobCategory() override
+    {
+        return jcBuild;
+    }
+
     void work() override;
 
     Path getDrvPath()
@@ -870,6 +1010,14 @@ private:
     /* Close the log file. */
     void closeLogFile();
 
+    /* Set the cost and expected memory use of this goal from the
+       previous builds of this derivation, if any. */
+    void estimateResources();
+
+    /* Record the time and resources used by the builder in the build
+       history. */
+    void recordBuild(bool success);
+
     /* Delete the temporary directory, if we have one. */
     void deleteTmpDir(bool force);
 
@@ -906,6 +1054,7 @@ DerivationGoal::DerivationGoal(const Path & drvPath, const StringSet & wantedOut
     state = &DerivationGoal::getDerivation;
     name = (format("building of ‘%1%’") % drvPath).str();
     trace("created");
+    estimateResources();
 }
 
 
@@ -920,6 +1069,7 @@ DerivationGoal::DerivationGoal(const Path & drvPath, const BasicDerivation & drv
     state = &DerivationGoal::haveDerivation;
     name = (format("building of %1%") % showPaths(drv.outputPaths())).str();
     trace("created");
+    estimateResources();
 
     /* Prevent the .chroot directory from being
        garbage-collected. (See isActiveTempFile() in gc.cc.) */
@@ -1331,6 +1481,7 @@ void DerivationGoal::tryToBuild()
             case rpAccept:
                 /* Yes, it has started doing so.  Wait until we get
                    EOF from the hook. */
+                result.startTime = time(0);
                 state = &DerivationGoal::buildDone;
                 return;
             case rpPostpone:
@@ -1348,16 +1499,20 @@ void DerivationGoal::tryToBuild()
     /* Make sure that we are allowed to start a build.  If this
        derivation prefers to be done locally, do it even if
        maxBuildJobs is 0. */
-    unsigned int curBuilds = worker.getNrLocalBuilds();
-    if (curBuilds >= settings.maxBuildJobs && !(buildLocally && curBuilds == 0)) {
-        worker.waitForBuildSlot(shared_from_this());
+    if (!worker.getBuildSlot(shared_from_this(),
+            buildLocally ? std::max(1U, settings.maxBuildJobs) : settings.maxBuildJobs))
+    {
         outputLocks.unlock();
         return;
     }
 
+    printMsg(lvlTalkative, format("starting build of ‘%1%’ (critical path %2%, %3% dependents)")
+        % drvPath % criticalPath % waiters.size());
+
     try {
 
         /* Okay, we have to build. */
+        result.startTime = time(0);
         startBuilder();
 
     } catch (BuildError & e) {
@@ -1403,10 +1558,25 @@ void DerivationGoal::buildDone()
        :-) */
     /* !!! this could block! security problem! solution: kill the
        child */
-    int status = hook ? hook->pid.wait(true) : pid.wait(true);
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    int status = hook ? hook->pid.wait(true) : pid.wait(true, &usage);
 
     debug(format("builder process for ‘%1%’ finished") % drvPath);
 
+    result.stopTime = time(0);
+    if (!hook) {
+        result.cpuUser = (uint64_t) usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+        result.cpuSystem = (uint64_t) usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+        /* ru_maxrss is in kilobytes on Linux, but in bytes on Darwin. */
+#if __APPLE__
+        result.peakRSS = usage.ru_maxrss;
+#else
+        result.peakRSS = (uint64_t) usage.ru_maxrss * 1024;
+#endif
+        recordBuild(statusOk(status));
+    }
+
     /* So the child is gone now. */
     worker.childTerminated(shared_from_this());
 
@@ -2879,6 +3049,42 @@ void DerivationGoal::closeLogFile()
 }
 
 
+void DerivationGoal::estimateResources()
+{
+    /* Derivations that have never been built count as one-second
+       builds. */
+    try {
+        auto history = getBuildHistory();
+        auto name = buildHistoryName(drvPath);
+        auto duration = history->estimateDuration(name);
+        if (duration >= 0) cost = criticalPath = std::max(duration, 1.0);
+        expectedMemory = history->estimatePeakRSS(name);
+    } catch (Error & e) {
+        debug(format("cannot query build history: %1%") % e.msg());
+    }
+}
+
+
+void DerivationGoal::recordBuild(bool success)
+{
+    /* Failing to record a build shouldn't fail the build. */
+    try {
+        BuildRecord record;
+        record.name = buildHistoryName(drvPath);
+        record.drvPath = drvPath;
+        record.success = success;
+        record.startTime = result.startTime;
+        record.stopTime = result.stopTime;
+        record.cpuUser = result.cpuUser;
+        record.cpuSystem = result.cpuSystem;
+        record.peakRSS = result.peakRSS;
+        getBuildHistory()->addBuild(record);
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: cannot record build of ‘%1%’: %2%") % drvPath % e.msg());
+    }
+}
+
+
 void DerivationGoal::deleteTmpDir(bool force)
 {
     if (tmpDir != "") {
@@ -3019,6 +3225,15 @@ private:
     std::thread thr;
 
     std::promise<void> promise;
+    std::future<void> future;
+
+    /* Lock on the store path, held from before it's fetched until
+       it's registered as valid. */
+    PathLocks outputLock;
+
+    /* Whether the path has been unpacked into the store but not yet
+       registered as valid. */
+    bool unpacked = false;
 
     /* Whether to try to repair a valid path. */
     bool repair;
@@ -3043,15 +3258,19 @@ public:
         return "a$" + storePathToName(storePath) + "$" + storePath;
     }
 
+    JobCategory jobCategory()
+    {
+        return jcSubstitution;
+    }
+
     void work();
 
     /* The states. */
     void init();
     void tryNext();
-    void gotInfo();
-    void referencesValid();
     void tryToRun();
     void finished();
+    void referencesValid();
 
     /* Callback used by the worker to write to the log. */
     void handleChildOutput(int fd, const string & data);
@@ -3080,6 +3299,9 @@ SubstitutionGoal::~SubstitutionGoal()
             thr.join();
             worker.childTerminated(shared_from_this());
         }
+        /* Don't leave behind a path that we unpacked but couldn't
+           register. */
+        if (unpacked && !repair) deletePath(storePath);
     } catch (...) {
         ignoreException();
     }
@@ -3152,48 +3374,65 @@ void SubstitutionGoal::tryNext()
         return;
     }
 
-    /* To maintain the closure invariant, we first have to realise the
-       paths referenced by this one. */
+    /* To maintain the closure invariant, we can only register this
+       path after the paths referenced by it.  But we can fetch it
+       while they're being realised, so that the paths in a closure
+       are downloaded concurrently rather than one level at a time. */
     for (auto & i : info->references)
         if (i != storePath) /* ignore self-references */
             addWaitee(worker.makeSubstitutionGoal(i));
 
-    if (waitees.empty()) /* to prevent hang (no wake-up event) */
-        referencesValid();
-    else
-        state = &SubstitutionGoal::referencesValid;
+    state = &SubstitutionGoal::tryToRun;
+    worker.wakeUp(shared_from_this());
 }
 
 
-void SubstitutionGoal::referencesValid()
+void SubstitutionGoal::tryToRun()
 {
-    trace("all references realised");
+    trace("trying to run");
 
+    /* We may be woken up by a reference that failed to be realised,
+       in which case there is no point in fetching this path. */
     if (nrFailed > 0) {
         debug(format("some references of path ‘%1%’ could not be realised") % storePath);
         amDone(nrNoSubstituters > 0 || nrIncompleteClosure > 0 ? ecIncompleteClosure : ecFailed);
         return;
     }
 
-    for (auto & i : info->references)
-        if (i != storePath) /* ignore self-references */
-            assert(worker.store.isValidPath(i));
-
-    state = &SubstitutionGoal::tryToRun;
-    worker.wakeUp(shared_from_this());
-}
+    /* Another goal in this process may hold the lock on the path
+       (e.g. a derivation goal building it), in which case
+       lockPaths() would throw.  Sleep until some goal finishes and
+       try again. */
+    if (pathIsLockedByMe(storePath)) {
+        debug(format("putting substitution of ‘%1%’ to sleep because it is locked by another goal")
+            % storePath);
+        worker.waitForAnyGoal(shared_from_this());
+        return;
+    }
 
+    /* Make sure that we are allowed to start a substitution.  This is
+       independent of maxBuildJobs: substitutions cannot be
+       distributed to another machine via the build hook, and they
+       mostly wait for the network rather than use the CPU. */
+    if (!worker.getBuildSlot(shared_from_this(), std::max(1U, settings.maxSubstitutionJobs)))
+        return;
 
-void SubstitutionGoal::tryToRun()
-{
-    trace("trying to run");
+    /* Lock the path, since another process may be substituting or
+       building it.  Don't wait for the lock while holding a slot:
+       the other process may need our slots to realise the references
+       of the path before it can release the lock. */
+    if (!outputLock.lockPaths({storePath}, "", false)) {
+        worker.waitForAWhile(shared_from_this());
+        return;
+    }
 
-    /* Make sure that we are allowed to start a build.  Note that even
-       is maxBuildJobs == 0 (no local builds allowed), we still allow
-       a substituter to run.  This is because substitutions cannot be
-       distributed to another machine via the build hook. */
-    if (worker.getNrLocalBuilds() >= (settings.maxBuildJobs == 0 ? 1 : settings.maxBuildJobs)) {
-        worker.waitForBuildSlot(shared_from_this());
+    /* Now that we hold the lock, check whether the path has become
+       valid in the meantime. */
+    if (!repair && worker.store.isValidPath(storePath)) {
+        debug(format("store path ‘%1%’ has become valid") % storePath);
+        outputLock.setDeletion(true);
+        outputLock.unlock();
+        amDone(ecSuccess);
         return;
     }
 
@@ -3202,15 +3441,18 @@ void SubstitutionGoal::tryToRun()
     outPipe.create();
 
     promise = std::promise<void>();
+    future = promise.get_future();
 
     thr = std::thread([this]() {
-        try {
-            /* Wake up the worker loop when we're done. */
-            Finally updateStats([this]() { outPipe.writeSide.close(); });
-
-            copyStorePath(ref<Store>(sub), ref<Store>(worker.store.shared_from_this()),
-                storePath, repair);
+        /* Wake up the worker loop when we're done. */
+        Finally updateStats([this]() { outPipe.writeSide.close(); });
 
+        try {
+            auto source = sinkToSource([&](Sink & sink) {
+                sub->narFromPath(storePath, sink);
+            });
+            worker.store.restoreFromNar(*info, *source);
+            unpacked = true;
             promise.set_value();
         } catch (...) {
             promise.set_exception(std::current_exception());
@@ -3225,15 +3467,20 @@ void SubstitutionGoal::tryToRun()
 
 void SubstitutionGoal::finished()
 {
+    /* We may be woken up by our references before the substituter
+       thread is done. */
+    if (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
     trace("substitute finished");
 
     thr.join();
     worker.childTerminated(shared_from_this());
 
     try {
-        promise.get_future().get();
+        future.get();
     } catch (Error & e) {
         printMsg(lvlInfo, e.msg());
+        outputLock.unlock();
 
         /* Try the next substitute. */
         state = &SubstitutionGoal::tryNext;
@@ -3241,6 +3488,36 @@ void SubstitutionGoal::finished()
         return;
     }
 
+    if (waitees.empty()) /* to prevent hang (no wake-up event) */
+        referencesValid();
+    else
+        state = &SubstitutionGoal::referencesValid;
+}
+
+
+void SubstitutionGoal::referencesValid()
+{
+    trace("all references realised");
+
+    if (nrFailed > 0) {
+        debug(format("some references of path ‘%1%’ could not be realised") % storePath);
+        if (!repair) deletePath(storePath);
+        unpacked = false;
+        outputLock.unlock();
+        amDone(nrNoSubstituters > 0 || nrIncompleteClosure > 0 ? ecIncompleteClosure : ecFailed);
+        return;
+    }
+
+    for (auto & i : info->references)
+        if (i != storePath) /* ignore self-references */
+            assert(worker.store.isValidPath(i));
+
+    worker.store.registerValidPath(*info);
+    unpacked = false;
+
+    outputLock.setDeletion(true);
+    outputLock.unlock();
+
     worker.markContentsGood(storePath);
 
     printMsg(lvlChatty,
@@ -3267,6 +3544,26 @@ void SubstitutionGoal::handleEOF(int fd)
 static bool working = false;
 
 
+/* Return the amount of memory available for starting new processes
+   without swapping, in bytes, or -1 if unknown. */
+static int64_t getAvailableMemory()
+{
+#if __linux__
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile("/proc/meminfo", true), "\n")) {
+            auto fields = tokenizeString<std::vector<string>>(line, " ");
+            int64_t n;
+            if (fields.size() >= 2 && fields[0] == "MemAvailable:" && string2Int(fields[1], n))
+                return n * 1024;
+        }
+    } catch (SysError & e) {
+        debug(format("cannot determine available memory: %1%") % e.msg());
+    }
+#endif
+    return -1;
+}
+
+
 Worker::Worker(LocalStore & store)
     : store(store)
 {
@@ -3274,9 +3571,20 @@ Worker::Worker(LocalStore & store)
     if (working) abort();
     working = true;
     nrLocalBuilds = 0;
+    nrSubstitutions = 0;
+    minFreeMemory = (uint64_t) std::max(0, settings.get("build-min-free-memory", 0)) * 1024 * 1024;
+    reservedMemory = 0;
+    waitingForMemory = false;
+    nrDelayedBuilds = 0;
+    totalBuildDelay = 0;
     lastWokenUp = 0;
     permanentFailure = false;
     timedOut = false;
+
+#if __linux__
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD == -1) throw SysError("creating epoll instance");
+#endif
 }
 
 
@@ -3381,48 +3689,192 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
 {
     Child child;
     child.goal = goal;
-    child.fds = fds;
     child.timeStarted = child.lastOutput = time(0);
     child.inBuildSlot = inBuildSlot;
+    child.expectedMemory = inBuildSlot && goal->jobCategory() == Goal::jcBuild ? goal->getExpectedMemory() : 0;
     child.respectTimeouts = respectTimeouts;
+    child.deadline = LONG_MAX;
     children.emplace_back(child);
-    if (inBuildSlot) nrLocalBuilds++;
+    auto & child2(children.back());
+    for (auto fd : fds) addChildFD(child2, fd);
+    updateDeadline(child2);
+    if (inBuildSlot) nrRunning(goal)++;
+    reservedMemory += child.expectedMemory;
 }
 
 
-void Worker::childTerminated(GoalPtr goal, bool wakeSleepers)
+void Worker::childTerminated(GoalPtr goal)
 {
     auto i = std::find_if(children.begin(), children.end(),
         [&](const Child & child) { return child.goal.lock() == goal; });
     assert(i != children.end());
 
     if (i->inBuildSlot) {
-        assert(nrLocalBuilds > 0);
-        nrLocalBuilds--;
+        assert(nrRunning(goal) > 0);
+        nrRunning(goal)--;
     }
 
+    assert(reservedMemory >= i->expectedMemory);
+    reservedMemory -= i->expectedMemory;
+
+    for (auto fd : set<int>(i->fds)) removeChildFD(fd);
+    if (i->deadline != LONG_MAX) deadlines.erase({i->deadline, &*i});
+
     children.erase(i);
+}
 
-    if (wakeSleepers) {
 
-        /* Wake up goals waiting for a build slot. */
-        for (auto & j : wantingToBuild) {
-            GoalPtr goal = j.lock();
-            if (goal) wakeUp(goal);
-        }
+void Worker::addChildFD(Child & child, int fd)
+{
+    /* A descriptor of a terminated child may have been closed and
+       reused without us noticing. */
+    if (childFDs.count(fd)) removeChildFD(fd);
+
+    child.fds.insert(fd);
+    childFDs[fd] = &child;
+
+#if __linux__
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) == -1 &&
+        (errno != EEXIST || epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &event) == -1))
+        throw SysError(format("monitoring file descriptor %1%") % fd);
+#endif
+}
+
+
+void Worker::removeChildFD(int fd)
+{
+    auto i = childFDs.find(fd);
+    if (i == childFDs.end()) return;
+    i->second->fds.erase(fd);
+    childFDs.erase(i);
+
+#if __linux__
+    /* This fails if the descriptor has already been closed, in
+       which case the kernel has already removed it. */
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, 0);
+#endif
+}
 
-        wantingToBuild.clear();
+
+void Worker::updateDeadline(Child & child)
+{
+    time_t deadline = LONG_MAX;
+    if (child.respectTimeouts) {
+        if (settings.maxSilentTime != 0)
+            deadline = std::min(deadline, child.lastOutput + (time_t) settings.maxSilentTime);
+        if (settings.buildTimeout != 0)
+            deadline = std::min(deadline, child.timeStarted + (time_t) settings.buildTimeout);
     }
+
+    if (deadline == child.deadline) return;
+    if (child.deadline != LONG_MAX) deadlines.erase({child.deadline, &child});
+    child.deadline = deadline;
+    if (deadline != LONG_MAX) deadlines.insert({deadline, &child});
 }
 
 
-void Worker::waitForBuildSlot(GoalPtr goal)
+bool Worker::getBuildSlot(GoalPtr goal, unsigned int maxJobs)
 {
+    auto i = granted.find(goal);
+    if (i != granted.end()) {
+        granted.erase(i);
+        if (nrRunning(goal) < maxJobs) return true;
+    }
+
     debug("wait for build slot");
-    if (getNrLocalBuilds() < settings.maxBuildJobs)
-        wakeUp(goal); /* we can do it right away */
-    else
-        addToWeakGoals(wantingToBuild, goal);
+    for (auto & j : wantingToBuild)
+        if (j.first.lock() == goal) return false;
+    wantingToBuild.emplace_back(goal, maxJobs);
+    return false;
+}
+
+
+/* The order in which goals get free build slots. Substitutions go
+   first, as in CompareGoalPtrs. Then derivations go in order of
+   decreasing critical path, so that the builds holding up the most
+   work are started first. */
+static bool compareBuildOrder(const GoalPtr & a, const GoalPtr & b)
+{
+    bool aIsBuild = a->jobCategory() == Goal::jcBuild;
+    bool bIsBuild = b->jobCategory() == Goal::jcBuild;
+    if (aIsBuild != bIsBuild) return bIsBuild;
+    if (!aIsBuild) return false;
+    if (a->getCriticalPath() != b->getCriticalPath())
+        return a->getCriticalPath() > b->getCriticalPath();
+    return a->getNrWaiters() > b->getNrWaiters();
+}
+
+
+bool Worker::grantBuildSlots()
+{
+    /* Grants that weren't used in the previous round (e.g. because
+       the build hook accepted the build) have lapsed. */
+    granted.clear();
+
+    waitingForMemory = false;
+
+    if (wantingToBuild.empty()) return false;
+
+    int64_t availableMemory = minFreeMemory ? getAvailableMemory() : -1;
+    uint64_t grantedMemory = 0;
+
+    Goals wanting2;
+    std::map<GoalPtr, unsigned int> maxJobs;
+    for (auto & i : wantingToBuild) {
+        GoalPtr goal = i.first.lock();
+        if (goal) {
+            wanting2.insert(goal);
+            maxJobs[goal] = i.second;
+        }
+    }
+
+    std::vector<GoalPtr> wanting(wanting2.begin(), wanting2.end());
+    std::stable_sort(wanting.begin(), wanting.end(), compareBuildOrder);
+
+    wantingToBuild.clear();
+
+    std::map<Goal::JobCategory, unsigned int> nrGranted;
+
+    for (auto & goal : wanting) {
+        auto & n(nrGranted[goal->jobCategory()]);
+        bool isBuild = goal->jobCategory() == Goal::jcBuild;
+
+        /* Always allow one local build, otherwise we'd never make
+           progress. */
+        bool haveMemory = !isBuild || availableMemory < 0 || nrLocalBuilds + n == 0
+            || (uint64_t) availableMemory >= minFreeMemory + reservedMemory + grantedMemory + goal->getExpectedMemory();
+
+        if (nrRunning(goal) + n < maxJobs[goal] && haveMemory) {
+            goal->trace(format("granted a slot (critical path %1%)") % goal->getCriticalPath());
+            granted.insert(goal);
+            n++;
+            if (isBuild) grantedMemory += goal->getExpectedMemory();
+            auto i = delayedBuilds.find(goal->key());
+            if (i != delayedBuilds.end()) {
+                totalBuildDelay += time(0) - i->second;
+                delayedBuilds.erase(i);
+            }
+            wakeUp(goal);
+        } else {
+            if (!haveMemory) {
+                waitingForMemory = true;
+                if (delayedBuilds.emplace(goal->key(), time(0)).second) {
+                    nrDelayedBuilds++;
+                    goal->trace(format("waiting for memory (%1% MiB available, %2% MiB reserved, %3% MiB expected)")
+                        % (availableMemory / (1024 * 1024))
+                        % ((reservedMemory + grantedMemory) / (1024 * 1024))
+                        % (goal->getExpectedMemory() / (1024 * 1024)));
+                }
+            }
+            wantingToBuild.emplace_back(goal, maxJobs[goal]);
+        }
+    }
+
+    return !granted.empty();
 }
 
 
@@ -3468,8 +3920,12 @@ void Worker::run(const Goals & _topGoals)
 
         if (topGoals.empty()) break;
 
+        /* Now that every goal has done what it can, hand out the free
+           build slots. */
+        if (grantBuildSlots()) continue;
+
         /* Wait for input. */
-        if (!children.empty() || !waitingForAWhile.empty())
+        if (!children.empty() || !waitingForAWhile.empty() || waitingForMemory)
             waitForInput();
         else {
             if (awake.empty() && settings.maxBuildJobs == 0) throw Error(
@@ -3485,6 +3941,10 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || awake.empty());
     assert(!settings.keepGoing || wantingToBuild.empty());
     assert(!settings.keepGoing || children.empty());
+
+    if (nrDelayedBuilds)
+        printMsg(lvlInfo, format("%1% builds were held back for lack of memory, for %2% seconds in total")
+            % nrDelayedBuilds % totalBuildDelay);
 }
 
 
@@ -3499,26 +3959,17 @@ void Worker::waitForInput()
        terminated. */
 
     bool useTimeout = false;
-    struct timeval timeout;
-    timeout.tv_usec = 0;
+    time_t timeout = 0;
     time_t before = time(0);
 
     /* If we're monitoring for silence on stdout/stderr, or if there
        is a build timeout, then wait for input until the first
        deadline for any child. */
     assert(sizeof(time_t) >= sizeof(long));
-    time_t nearest = LONG_MAX; // nearest deadline
-    for (auto & i : children) {
-        if (!i.respectTimeouts) continue;
-        if (settings.maxSilentTime != 0)
-            nearest = std::min(nearest, i.lastOutput + settings.maxSilentTime);
-        if (settings.buildTimeout != 0)
-            nearest = std::min(nearest, i.timeStarted + settings.buildTimeout);
-    }
-    if (nearest != LONG_MAX) {
-        timeout.tv_sec = std::max((time_t) 1, nearest - before);
+    if (!deadlines.empty()) {
+        timeout = std::max((time_t) 1, deadlines.begin()->first - before);
         useTimeout = true;
-        printMsg(lvlVomit, format("sleeping %1% seconds") % timeout.tv_sec);
+        printMsg(lvlVomit, format("sleeping %1% seconds") % timeout);
     }
 
     /* If we are polling goals that are waiting for a lock, then wake
@@ -3528,83 +3979,109 @@ void Worker::waitForInput()
         if (lastWokenUp == 0)
             printMsg(lvlError, "waiting for locks or build slots...");
         if (lastWokenUp == 0 || lastWokenUp > before) lastWokenUp = before;
-        timeout.tv_sec = std::max((time_t) 1, (time_t) (lastWokenUp + settings.pollInterval - before));
+        timeout = std::max((time_t) 1, (time_t) (lastWokenUp + settings.pollInterval - before));
     } else lastWokenUp = 0;
 
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
-       includes EOF. */
-    fd_set fds;
-    FD_ZERO(&fds);
-    int fdMax = 0;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
-            FD_SET(j, &fds);
-            if (j >= fdMax) fdMax = j + 1;
-        }
+    /* If builds are held back for lack of memory, check again after
+       a few seconds. */
+    if (waitingForMemory) {
+        timeout = useTimeout ? std::min(timeout, (time_t) settings.pollInterval) : (time_t) settings.pollInterval;
+        useTimeout = true;
     }
 
-    if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
+    /* Wake up at least once a day, to keep the timeout in range. */
+    int timeoutMs = useTimeout ? std::min(timeout, (time_t) 24 * 60 * 60) * 1000 : -1;
+
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
+       includes EOF. */
+    std::vector<int> readyFDs;
+
+#if __linux__
+    struct epoll_event events[128];
+    int count = epoll_wait(epollFD, events, sizeof(events) / sizeof(events[0]), timeoutMs);
+    if (count == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
+    }
+    for (int n = 0; n < count; ++n)
+        readyFDs.push_back(events[n].data.fd);
+#else
+    std::vector<struct pollfd> pollFDs;
+    for (auto & i : childFDs) {
+        struct pollfd pfd;
+        pfd.fd = i.first;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pollFDs.push_back(pfd);
+    }
+    if (poll(pollFDs.data(), pollFDs.size(), timeoutMs) == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
+    for (auto & pfd : pollFDs)
+        if (pfd.revents) readyFDs.push_back(pfd.fd);
+#endif
 
     time_t after = time(0);
 
     /* Process all available file descriptors. */
-    decltype(children)::iterator i;
-    for (auto j = children.begin(); j != children.end(); j = i) {
-        i = std::next(j);
-
+    for (auto fd : readyFDs) {
         checkInterrupt();
 
-        GoalPtr goal = j->goal.lock();
+        /* The child may have gone away while processing a previous
+           descriptor. */
+        auto i = childFDs.find(fd);
+        if (i == childFDs.end()) continue;
+        Child & child(*i->second);
+
+        GoalPtr goal = child.goal.lock();
         assert(goal);
 
-        set<int> fds2(j->fds);
-        for (auto & k : fds2) {
-            if (FD_ISSET(k, &fds)) {
-                unsigned char buffer[4096];
-                ssize_t rd = read(k, buffer, sizeof(buffer));
-                if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError(format("reading from %1%")
-                            % goal->getName());
-                } else if (rd == 0) {
-                    debug(format("%1%: got EOF") % goal->getName());
-                    goal->handleEOF(k);
-                    j->fds.erase(k);
-                } else {
-                    printMsg(lvlVomit, format("%1%: read %2% bytes")
-                        % goal->getName() % rd);
-                    string data((char *) buffer, rd);
-                    j->lastOutput = after;
-                    goal->handleChildOutput(k, data);
-                }
-            }
+        unsigned char buffer[4096];
+        ssize_t rd = read(fd, buffer, sizeof(buffer));
+        if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError(format("reading from %1%")
+                    % goal->getName());
+        } else if (rd == 0) {
+            debug(format("%1%: got EOF") % goal->getName());
+            removeChildFD(fd);
+            goal->handleEOF(fd);
+        } else {
+            printMsg(lvlVomit, format("%1%: read %2% bytes")
+                % goal->getName() % rd);
+            string data((char *) buffer, rd);
+            child.lastOutput = after;
+            updateDeadline(child);
+            goal->handleChildOutput(fd, data);
         }
+    }
+
+    /* Kill the children whose deadline has passed. */
+    while (!deadlines.empty() && deadlines.begin()->first <= after) {
+        Child & child(*deadlines.begin()->second);
+        deadlines.erase(deadlines.begin());
+        child.deadline = LONG_MAX;
+
+        checkInterrupt();
+
+        GoalPtr goal = child.goal.lock();
+        assert(goal);
+
+        if (goal->getExitCode() != Goal::ecBusy) continue;
 
-        if (goal->getExitCode() == Goal::ecBusy &&
-            settings.maxSilentTime != 0 &&
-            j->respectTimeouts &&
-            after - j->lastOutput >= (time_t) settings.maxSilentTime)
-        {
+        if (settings.maxSilentTime != 0 &&
+            after - child.lastOutput >= (time_t) settings.maxSilentTime)
             printMsg(lvlError,
                 format("%1% timed out after %2% seconds of silence")
                 % goal->getName() % settings.maxSilentTime);
-            goal->timedOut();
-        }
-
-        else if (goal->getExitCode() == Goal::ecBusy &&
-            settings.buildTimeout != 0 &&
-            j->respectTimeouts &&
-            after - j->timeStarted >= (time_t) settings.buildTimeout)
-        {
+        else
             printMsg(lvlError,
                 format("%1% timed out after %2% seconds")
                 % goal->getName() % settings.buildTimeout);
-            goal->timedOut();
-        }
+
+        goal->timedOut();
     }
 
     if (!waitingForAWhile.empty() && lastWokenUp + (time_t) settings.pollInterval <= after) {
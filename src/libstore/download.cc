@@ -3,10 +3,19 @@
 #include "globals.hh"
 #include "hash.hh"
 #include "store-api.hh"
+#include "sync.hh"
+#include "serialise.hh"
 
 #include <curl/curl.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <condition_variable>
 
 
 namespace nix {
@@ -28,199 +37,551 @@ std::string resolveUri(const std::string & uri)
 
 struct CurlDownloader : public Downloader
 {
-    CURL * curl;
-    ref<std::string> data;
-    string etag, status, expectedETag;
-
-    struct curl_slist * requestHeaders;
+    CURLM * curlm = 0;
 
-    bool showProgress;
-    double prevProgressTime{0}, startTime{0};
-    unsigned int moveBack{1};
+    /* Maximum number of bytes of a streaming download that may be
+       buffered before the transfer is paused. */
+    static const size_t streamBufferSize = 1024 * 1024;
 
-    size_t writeCallback(void * contents, size_t size, size_t nmemb)
+    /* Data passed from the download thread to the consumer of a
+       streaming download. */
+    struct DownloadStream
     {
-        size_t realSize = size * nmemb;
-        data->append((char *) contents, realSize);
-        return realSize;
-    }
+        struct State
+        {
+            std::string data;
+            bool paused = false; // whether the transfer is paused because ‘data’ is full
+            bool finished = false;
+            bool aborted = false; // whether the consumer has given up
+            std::exception_ptr exc;
+        };
 
-    static size_t writeCallbackWrapper(void * contents, size_t size, size_t nmemb, void * userp)
-    {
-        return ((CurlDownloader *) userp)->writeCallback(contents, size, nmemb);
-    }
+        Sync<State> state_;
+
+        std::condition_variable wakeup;
+    };
 
-    size_t headerCallback(void * contents, size_t size, size_t nmemb)
+    struct DownloadItem : public std::enable_shared_from_this<DownloadItem>
     {
-        size_t realSize = size * nmemb;
-        string line = string((char *) contents, realSize);
-        printMsg(lvlVomit, format("got header: %1%") % trim(line));
-        if (line.compare(0, 5, "HTTP/") == 0) { // new response starts
-            etag = "";
-            auto ss = tokenizeString<vector<string>>(line, " ");
-            status = ss.size() >= 2 ? ss[1] : "";
-        } else {
-            auto i = line.find(':');
-            if (i != string::npos) {
-                string name = trim(string(line, 0, i));
-                if (name == "ETag") { // FIXME: case
-                    etag = trim(string(line, i + 1));
-                    /* Hack to work around a GitHub bug: it sends
-                       ETags, but ignores If-None-Match. So if we get
-                       the expected ETag on a 200 response, then shut
-                       down the connection because we already have the
-                       data. */
-                    printMsg(lvlDebug, format("got ETag: %1%") % etag);
-                    if (etag == expectedETag && status == "200") {
-                        printMsg(lvlDebug, format("shutting down on 200 HTTP response with expected ETag"));
-                        return 0;
+        CurlDownloader & downloader;
+        std::string uri;
+        DownloadOptions options;
+        DownloadResult result;
+        std::function<void(const DownloadResult &)> success;
+        std::function<void(std::exception_ptr exc)> failure;
+        bool done = false; // whether either the success or failure function has been called
+        CURL * req = 0;
+        bool active = false; // whether the handle has been added to the multi object
+        std::string status, expectedETag;
+        struct curl_slist * requestHeaders = 0;
+
+        /* If set, the body of the response is appended to this
+           buffer rather than to result.data. */
+        std::shared_ptr<DownloadStream> stream;
+
+        bool showProgress;
+        double prevProgressTime{0}, startTime{0};
+        unsigned int moveBack{1};
+
+        DownloadItem(CurlDownloader & downloader, const std::string & uri,
+            const DownloadOptions & options)
+            : downloader(downloader), uri(uri), options(options)
+        {
+            result.data = std::make_shared<std::string>();
+
+            showProgress =
+                options.showProgress == DownloadOptions::yes ||
+                (options.showProgress == DownloadOptions::automatic && isatty(STDERR_FILENO));
+
+            if (!options.expectedETag.empty()) {
+                expectedETag = options.expectedETag;
+                requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + options.expectedETag).c_str());
+            }
+        }
+
+        ~DownloadItem()
+        {
+            if (req) {
+                if (active)
+                    curl_multi_remove_handle(downloader.curlm, req);
+                curl_easy_cleanup(req);
+            }
+            if (requestHeaders) curl_slist_free_all(requestHeaders);
+            try {
+                if (!done)
+                    fail(DownloadError(Downloader::Misc, format("download of ‘%s’ was interrupted") % uri));
+            } catch (...) {
+                ignoreException();
+            }
+        }
+
+        template<class T>
+        void fail(const T & e)
+        {
+            assert(!done);
+            done = true;
+            failure(std::make_exception_ptr(e));
+        }
+
+        size_t writeCallback(void * contents, size_t size, size_t nmemb)
+        {
+            size_t realSize = size * nmemb;
+            if (stream) {
+                auto state(stream->state_.lock());
+                if (state->aborted) return 0;
+                if (state->data.size() >= streamBufferSize) {
+                    state->paused = true;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+                state->data.append((char *) contents, realSize);
+                stream->wakeup.notify_one();
+            } else
+                result.data->append((char *) contents, realSize);
+            return realSize;
+        }
+
+        static size_t writeCallbackWrapper(void * contents, size_t size, size_t nmemb, void * userp)
+        {
+            return ((DownloadItem *) userp)->writeCallback(contents, size, nmemb);
+        }
+
+        size_t headerCallback(void * contents, size_t size, size_t nmemb)
+        {
+            size_t realSize = size * nmemb;
+            string line = string((char *) contents, realSize);
+            printMsg(lvlVomit, format("got header for ‘%s’: %s") % uri % trim(line));
+            if (line.compare(0, 5, "HTTP/") == 0) { // new response starts
+                result.etag = "";
+                auto ss = tokenizeString<vector<string>>(line, " ");
+                status = ss.size() >= 2 ? ss[1] : "";
+            } else {
+                auto i = line.find(':');
+                if (i != string::npos) {
+                    string name = trim(string(line, 0, i));
+                    if (name == "ETag") { // FIXME: case
+                        result.etag = trim(string(line, i + 1));
+                        /* Hack to work around a GitHub bug: it sends
+                           ETags, but ignores If-None-Match. So if we get
+                           the expected ETag on a 200 response, then shut
+                           down the connection because we already have the
+                           data. */
+                        printMsg(lvlDebug, format("got ETag: %1%") % result.etag);
+                        if (result.etag == expectedETag && status == "200") {
+                            printMsg(lvlDebug, format("shutting down on 200 HTTP response with expected ETag"));
+                            return 0;
+                        }
                     }
                 }
             }
+            return realSize;
         }
-        return realSize;
-    }
 
-    static size_t headerCallbackWrapper(void * contents, size_t size, size_t nmemb, void * userp)
-    {
-        return ((CurlDownloader *) userp)->headerCallback(contents, size, nmemb);
-    }
+        static size_t headerCallbackWrapper(void * contents, size_t size, size_t nmemb, void * userp)
+        {
+            return ((DownloadItem *) userp)->headerCallback(contents, size, nmemb);
+        }
 
-    int progressCallback(double dltotal, double dlnow)
-    {
-        if (showProgress) {
-            double now = getTime();
-            if (prevProgressTime <= now - 1) {
-                string s = (format(" [%1$.0f/%2$.0f KiB, %3$.1f KiB/s]")
-                    % (dlnow / 1024.0)
-                    % (dltotal / 1024.0)
-                    % (now == startTime ? 0 : dlnow / 1024.0 / (now - startTime))).str();
-                std::cerr << "\e[" << moveBack << "D" << s;
-                moveBack = s.size();
+        int progressCallback(double dltotal, double dlnow)
+        {
+            if (showProgress) {
+                double now = getTime();
+                if (prevProgressTime <= now - 1) {
+                    string s = (format(" [%1$.0f/%2$.0f KiB, %3$.1f KiB/s]")
+                        % (dlnow / 1024.0)
+                        % (dltotal / 1024.0)
+                        % (now == startTime ? 0 : dlnow / 1024.0 / (now - startTime))).str();
+                    std::cerr << "\e[" << moveBack << "D" << s;
+                    moveBack = s.size();
+                    std::cerr.flush();
+                    prevProgressTime = now;
+                }
+            }
+            return _isInterrupted;
+        }
+
+        static int progressCallbackWrapper(void * userp, double dltotal, double dlnow, double ultotal, double ulnow)
+        {
+            return ((DownloadItem *) userp)->progressCallback(dltotal, dlnow);
+        }
+
+        void init()
+        {
+            // FIXME: handle parallel downloads.
+            if (showProgress) {
+                std::cerr << (format("downloading ‘%1%’... ") % uri);
                 std::cerr.flush();
-                prevProgressTime = now;
+                startTime = getTime();
+            }
+
+            if (!req) req = curl_easy_init();
+            if (!req) throw nix::Error("unable to initialize curl");
+
+            curl_easy_reset(req);
+            curl_easy_setopt(req, CURLOPT_URL, uri.c_str());
+            curl_easy_setopt(req, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(req, CURLOPT_NOSIGNAL, 1);
+            curl_easy_setopt(req, CURLOPT_USERAGENT, ("Nix/" + nixVersion).c_str());
+            curl_easy_setopt(req, CURLOPT_FAILONERROR, 1);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+            /* Prefer waiting for an existing (multiplexed) connection
+               over opening a new one. */
+            curl_easy_setopt(req, CURLOPT_PIPEWAIT, 1);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+            if (downloader.enableHttp2)
+                curl_easy_setopt(req, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+            curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, DownloadItem::writeCallbackWrapper);
+            curl_easy_setopt(req, CURLOPT_WRITEDATA, this);
+            curl_easy_setopt(req, CURLOPT_HEADERFUNCTION, DownloadItem::headerCallbackWrapper);
+            curl_easy_setopt(req, CURLOPT_HEADERDATA, this);
+
+            curl_easy_setopt(req, CURLOPT_PROGRESSFUNCTION, progressCallbackWrapper);
+            curl_easy_setopt(req, CURLOPT_PROGRESSDATA, this);
+            curl_easy_setopt(req, CURLOPT_NOPROGRESS, 0);
+
+            curl_easy_setopt(req, CURLOPT_HTTPHEADER, requestHeaders);
+
+            if (options.head)
+                curl_easy_setopt(req, CURLOPT_NOBODY, 1);
+
+            if (options.verifyTLS)
+                curl_easy_setopt(req, CURLOPT_CAINFO, getEnv("SSL_CERT_FILE", "/etc/ssl/certs/ca-certificates.crt").c_str());
+            else {
+                curl_easy_setopt(req, CURLOPT_SSL_VERIFYPEER, 0);
+                curl_easy_setopt(req, CURLOPT_SSL_VERIFYHOST, 0);
             }
+
+            result.data = std::make_shared<std::string>();
         }
-        return _isInterrupted;
-    }
 
-    static int progressCallbackWrapper(void * userp, double dltotal, double dlnow, double ultotal, double ulnow)
+        void finish(CURLcode code)
+        {
+            if (showProgress)
+                //std::cerr << "\e[" << moveBack << "D\e[K\n";
+                std::cerr << "\n";
+
+            long httpStatus = 0;
+            curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &httpStatus);
+
+            char * effectiveUrlCStr;
+            curl_easy_getinfo(req, CURLINFO_EFFECTIVE_URL, &effectiveUrlCStr);
+
+            debug(format("finished download of ‘%s’; curl status = %d, HTTP status = %d")
+                % (effectiveUrlCStr ? effectiveUrlCStr : uri) % code % httpStatus);
+
+            if (code == CURLE_WRITE_ERROR && result.etag == options.expectedETag) {
+                result.cached = true;
+                done = true;
+                success(result);
+            }
+
+            else if (code == CURLE_OK && httpStatus == 304) {
+                result.cached = true;
+                done = true;
+                success(result);
+            }
+
+            else if (code == CURLE_OK) {
+                result.cached = false;
+                done = true;
+                success(result);
+            }
+
+            else if (code == CURLE_ABORTED_BY_CALLBACK && _isInterrupted)
+                fail(Interrupted(format("download of ‘%s’ was interrupted") % uri));
+
+            else {
+                Error err =
+                    httpStatus == 404 ? NotFound :
+                    httpStatus == 403 ? Forbidden : Misc;
+                fail(DownloadError(err, format("unable to download ‘%1%’: %2% (%3%)")
+                    % uri % curl_easy_strerror(code) % code));
+            }
+        }
+    };
+
+    struct State
     {
-        return ((CurlDownloader *) userp)->progressCallback(dltotal, dlnow);
-    }
+        bool quit = false;
+        std::vector<std::shared_ptr<DownloadItem>> incoming;
+        std::vector<std::weak_ptr<DownloadItem>> unpause;
+    };
+
+    Sync<State> state_;
+
+    /* We can't use a std::condition_variable to wake up the curl
+       thread, because it only monitors file descriptors. So use a
+       pipe instead. */
+    Pipe wakeupPipe;
+
+    std::thread workerThread;
+
+    /* The process that started the worker thread. After a fork, the
+       worker thread doesn't exist in the child. */
+    pid_t workerPid;
+
+    bool enableHttp2;
 
     CurlDownloader()
-        : data(make_ref<std::string>())
     {
-        requestHeaders = 0;
+        static std::once_flag globalInit;
+        std::call_once(globalInit, curl_global_init, CURL_GLOBAL_ALL);
 
-        curl = curl_easy_init();
-        if (!curl) throw nix::Error("unable to initialize curl");
-    }
+        curlm = curl_multi_init();
+        if (!curlm) throw nix::Error("unable to initialize curl");
 
-    ~CurlDownloader()
-    {
-        if (curl) curl_easy_cleanup(curl);
-        if (requestHeaders) curl_slist_free_all(requestHeaders);
+        enableHttp2 = settings.get("binary-caches-http2", true);
+
+#if LIBCURL_VERSION_NUM >= 0x072b00 // correct?
+        curl_multi_setopt(curlm, CURLMOPT_PIPELINING,
+            enableHttp2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00 // Max connections requires >= 7.30.0
+        curl_multi_setopt(curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+            (long) settings.get("binary-caches-parallel-connections", 25));
+#endif
+
+        wakeupPipe.create();
+        fcntl(wakeupPipe.readSide, F_SETFL, O_NONBLOCK);
+
+        workerPid = getpid();
+        workerThread = std::thread([&]() { workerThreadEntry(); });
     }
 
-    bool fetch(const string & url, const DownloadOptions & options)
+    ~CurlDownloader()
     {
-        showProgress =
-            options.showProgress == DownloadOptions::yes ||
-            (options.showProgress == DownloadOptions::automatic && isatty(STDERR_FILENO));
+        /* After a fork, the worker thread belongs to the parent, so
+           there is nothing to shut down. */
+        if (getpid() != workerPid) {
+            new std::thread(std::move(workerThread)); // deliberately leaked
+            return;
+        }
 
-        curl_easy_reset(curl);
+        /* Signal the worker thread to exit. */
+        {
+            auto state(state_.lock());
+            state->quit = true;
+        }
+        writeFull(wakeupPipe.writeSide, " ");
 
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, ("Nix/" + nixVersion).c_str());
-        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+        workerThread.join();
 
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallbackWrapper);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) this);
+        if (curlm) curl_multi_cleanup(curlm);
+    }
 
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerCallbackWrapper);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *) this);
+    void workerThreadMain()
+    {
+        std::map<CURL *, std::shared_ptr<DownloadItem>> items;
+
+        bool quit = false;
+
+        while (!quit) {
+
+            /* Let curl do its thing. */
+            int running;
+            CURLMcode mc = curl_multi_perform(curlm, &running);
+            if (mc != CURLM_OK)
+                throw nix::Error(format("unexpected error from curl_multi_perform(): %s") % curl_multi_strerror(mc));
+
+            /* Set the promises of any finished requests. */
+            CURLMsg * msg;
+            int left;
+            while ((msg = curl_multi_info_read(curlm, &left))) {
+                if (msg->msg == CURLMSG_DONE) {
+                    auto i = items.find(msg->easy_handle);
+                    assert(i != items.end());
+                    auto item = i->second;
+                    items.erase(i);
+                    curl_multi_remove_handle(curlm, item->req);
+                    item->active = false;
+                    item->finish(msg->data.result);
+                }
+            }
 
-        curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, progressCallbackWrapper);
-        curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, (void *) this);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
+            /* Wait for activity, including wakeup events. */
+            int numfds = 0;
+            struct curl_waitfd extraFDs[1];
+            extraFDs[0].fd = wakeupPipe.readSide;
+            extraFDs[0].events = CURL_WAIT_POLLIN;
+            extraFDs[0].revents = 0;
+            mc = curl_multi_wait(curlm, extraFDs, 1, items.empty() ? 10000 : 100, &numfds);
+            if (mc != CURLM_OK)
+                throw nix::Error(format("unexpected error from curl_multi_wait(): %s") % curl_multi_strerror(mc));
+
+            /* If the wakeup pipe is ready, drain it. */
+            if (extraFDs[0].revents & CURL_WAIT_POLLIN) {
+                char buf[1024];
+                auto res = read(extraFDs[0].fd, buf, sizeof(buf));
+                if (res == -1 && errno != EINTR && errno != EAGAIN)
+                    throw SysError("reading curl wakeup pipe");
+            }
 
-        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+            /* Add new curl requests from the incoming requests queue. */
+            std::vector<std::shared_ptr<DownloadItem>> incoming;
+            std::vector<std::weak_ptr<DownloadItem>> unpause;
+            {
+                auto state(state_.lock());
+                std::swap(state->incoming, incoming);
+                std::swap(state->unpause, unpause);
+                quit = state->quit;
+            }
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            /* Resume streaming downloads whose consumer has caught
+               up. Note that this may call the write callback. */
+            for (auto & i : unpause) {
+                auto item = i.lock();
+                if (item && item->active)
+                    curl_easy_pause(item->req, CURLPAUSE_CONT);
+            }
 
-        if (options.verifyTLS)
-            curl_easy_setopt(curl, CURLOPT_CAINFO, getEnv("SSL_CERT_FILE", "/etc/ssl/certs/ca-certificates.crt").c_str());
-        else {
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+            for (auto & item : incoming) {
+                debug(format("starting download of ‘%s’") % item->uri);
+                item->init();
+                curl_multi_add_handle(curlm, item->req);
+                item->active = true;
+                items[item->req] = item;
+            }
         }
 
-        data->clear();
+        debug("download thread shutting down");
+    }
 
-        if (requestHeaders) {
-            curl_slist_free_all(requestHeaders);
-            requestHeaders = 0;
+    void workerThreadEntry()
+    {
+        try {
+            workerThreadMain();
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("unexpected error in download thread: %s") % e.what());
         }
 
-        if (!options.expectedETag.empty()) {
-            this->expectedETag = options.expectedETag;
-            requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + options.expectedETag).c_str());
+        /* Fail any requests that were enqueued after we stopped; the
+           ones that were in progress are failed by the destructor of
+           DownloadItem. */
+        auto state(state_.lock());
+        state->incoming.clear();
+        state->quit = true;
+    }
+
+    void enqueueItem(std::shared_ptr<DownloadItem> item)
+    {
+        {
+            auto state(state_.lock());
+            if (state->quit)
+                throw nix::Error("cannot enqueue download request because the download thread is shutting down");
+            state->incoming.push_back(item);
         }
+        writeFull(wakeupPipe.writeSide, " ");
+    }
 
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, requestHeaders);
+    void enqueueDownload(const string & url, const DownloadOptions & options,
+        std::function<void(const DownloadResult &)> success,
+        std::function<void(std::exception_ptr exc)> failure) override
+    {
+        auto item = std::make_shared<DownloadItem>(*this, resolveUri(url), options);
+        item->success = success;
+        item->failure = failure;
+        enqueueItem(item);
+    }
 
-        if (options.head)
-            curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+    void unpauseItem(std::weak_ptr<DownloadItem> item)
+    {
+        state_.lock()->unpause.push_back(item);
+        writeFull(wakeupPipe.writeSide, " ");
+    }
 
-        if (showProgress) {
-            std::cerr << (format("downloading ‘%1%’... ") % url);
-            std::cerr.flush();
-            startTime = getTime();
+    void download(string url, const DownloadOptions & options, Sink & sink) override
+    {
+        auto stream = std::make_shared<DownloadStream>();
+
+        /* Only the download thread holds a reference to the item, so
+           that it's failed if the thread shuts down. */
+        std::weak_ptr<DownloadItem> weakItem;
+        {
+            auto item = std::make_shared<DownloadItem>(*this, resolveUri(url), options);
+            item->stream = stream;
+            item->success = [stream](const DownloadResult & result) {
+                auto state(stream->state_.lock());
+                state->finished = true;
+                stream->wakeup.notify_one();
+            };
+            item->failure = [stream](std::exception_ptr exc) {
+                auto state(stream->state_.lock());
+                state->finished = true;
+                state->exc = exc;
+                stream->wakeup.notify_one();
+            };
+            weakItem = item;
+            enqueueItem(item);
         }
 
-        CURLcode res = curl_easy_perform(curl);
-        if (showProgress)
-            //std::cerr << "\e[" << moveBack << "D\e[K\n";
-            std::cerr << "\n";
-        checkInterrupt();
-        if (res == CURLE_WRITE_ERROR && etag == options.expectedETag) return false;
-
-        long httpStatus = -1;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatus);
-
-        if (res != CURLE_OK) {
-            Error err =
-                httpStatus == 404 ? NotFound :
-                httpStatus == 403 ? Forbidden : Misc;
-            throw DownloadError(err, format("unable to download ‘%1%’: %2% (%3%)")
-                % url % curl_easy_strerror(res) % res);
+        /* Pass the data to the sink in this thread, so that slow
+           sinks (such as decompressors) don't hold up the download
+           thread. */
+        try {
+            while (true) {
+                std::string data;
+                bool paused = false;
+                {
+                    auto state(stream->state_.lock());
+                    while (state->data.empty() && !state->finished)
+                        state.wait(stream->wakeup);
+                    if (state->data.empty()) {
+                        if (state->exc) std::rethrow_exception(state->exc);
+                        break;
+                    }
+                    std::swap(data, state->data);
+                    std::swap(paused, state->paused);
+                }
+                if (paused) unpauseItem(weakItem);
+                sink((unsigned char *) data.data(), data.size());
+            }
+        } catch (...) {
+            /* Make the write callback abort the transfer. */
+            stream->state_.lock()->aborted = true;
+            unpauseItem(weakItem);
+            throw;
         }
+    }
+};
 
-        if (httpStatus == 304) return false;
+ref<Downloader> getDownloader()
+{
+    static std::shared_ptr<Downloader> downloader;
+    static pid_t downloaderPid = 0;
+    static std::mutex lock;
 
-        return true;
-    }
+    std::lock_guard<std::mutex> guard(lock);
 
-    DownloadResult download(string url, const DownloadOptions & options) override
-    {
-        DownloadResult res;
-        if (fetch(resolveUri(url), options)) {
-            res.cached = false;
-            res.data = data;
-        } else
-            res.cached = true;
-        res.etag = etag;
-        return res;
+    /* After a fork, the child needs its own downloader, since the
+       worker thread of the parent's doesn't exist there. */
+    if (!downloader || downloaderPid != getpid()) {
+        downloader = makeDownloader();
+        downloaderPid = getpid();
     }
-};
+
+    return ref<Downloader>(downloader);
+}
 
 ref<Downloader> makeDownloader()
 {
     return make_ref<CurlDownloader>();
 }
 
+std::future<DownloadResult> Downloader::enqueueDownload(const string & url, const DownloadOptions & options)
+{
+    auto promise = std::make_shared<std::promise<DownloadResult>>();
+    enqueueDownload(url, options,
+        [promise](const DownloadResult & result) { promise->set_value(result); },
+        [promise](std::exception_ptr exc) { promise->set_exception(exc); });
+    return promise->get_future();
+}
+
+DownloadResult Downloader::download(string url, const DownloadOptions & options)
+{
+    return enqueueDownload(url, options).get();
+}
+
 Path Downloader::downloadCached(ref<Store> store, const string & url_, bool unpack)
 {
     auto url = resolveUri(url_);
@@ -3,6 +3,8 @@
 #include "types.hh"
 
 #include <string>
+#include <functional>
+#include <future>
 
 namespace nix {
 
@@ -22,16 +24,41 @@ struct DownloadResult
 };
 
 class Store;
+struct Sink;
 
 struct Downloader
 {
-    virtual DownloadResult download(string url, const DownloadOptions & options) = 0;
+    /* Enqueue a download request, returning immediately. Either
+       ‘success’ or ‘failure’ will be called (from the download thread)
+       once the request has finished. Requests are processed
+       concurrently, sharing connections where possible. */
+    virtual void enqueueDownload(const string & url, const DownloadOptions & options,
+        std::function<void(const DownloadResult &)> success,
+        std::function<void(std::exception_ptr exc)> failure) = 0;
+
+    /* Enqueue a download request, returning a future for the
+       result. */
+    std::future<DownloadResult> enqueueDownload(const string & url, const DownloadOptions & options);
+
+    /* Synchronously download a file. */
+    DownloadResult download(string url, const DownloadOptions & options);
+
+    /* Synchronously download a file, passing the body of the response
+       to ‘sink’ as it is received. The sink is called from the calling
+       thread; if it falls behind, the transfer is paused rather than
+       buffered in memory. */
+    virtual void download(string url, const DownloadOptions & options, Sink & sink) = 0;
 
     Path downloadCached(ref<Store> store, const string & url, bool unpack);
 
     enum Error { NotFound, Forbidden, Misc };
 };
 
+/* Return a shared Downloader object. Using this object is preferred
+   because it enables connection reuse and HTTP/2 multiplexing. */
+ref<Downloader> getDownloader();
+
+/* Return a new Downloader object. */
 ref<Downloader> makeDownloader();
 
 class DownloadError : public Error
@@ -4,6 +4,9 @@
 
 #include <algorithm>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace nix {
 
 struct HashAndWriteSink : Sink
@@ -61,39 +64,33 @@ void Store::exportPath(const Path & path, Sink & sink)
     hashAndWriteSink << exportMagic << path << info->references << info->deriver << 0;
 }
 
-struct TeeSource : Source
-{
-    Source & readSource;
-    ref<std::string> data;
-    TeeSource(Source & readSource)
-        : readSource(readSource)
-        , data(make_ref<std::string>())
-    {
-    }
-    size_t read(unsigned char * data, size_t len)
-    {
-        size_t n = readSource.read(data, len);
-        this->data->append((char *) data, n);
-        return n;
-    }
-};
-
-struct NopSink : ParseSink
-{
-};
-
 Paths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor)
 {
+    /* The store path and references of each path follow its NAR, so
+       we can't stream the NAR directly into the store. Instead, spool
+       it to a temporary file to keep memory usage bounded. */
+    AutoDelete tmpDir(createTempDir(), true);
+    Path narFile = (Path) tmpDir + "/nar";
+
     Paths res;
     while (true) {
         unsigned long long n = readLongLong(source);
         if (n == 0) break;
         if (n != 1) throw Error("input doesn't look like something created by ‘nix-store --export’");
 
-        /* Extract the NAR from the source. */
-        TeeSource tee(source);
-        NopSink sink;
-        parseDump(sink, tee);
+        AutoCloseFD fd = open(narFile.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) throw SysError(format("creating file ‘%1%’") % narFile);
+
+        /* Extract the NAR from the source, hashing it along the
+           way. */
+        HashSink hashSink(htSHA256);
+        {
+            FdSink fileSink(fd);
+            TeeSource tee(source, fileSink);
+            TeeSource tee2(tee, hashSink);
+            ParseSink sink;
+            parseDump(sink, tee2);
+        }
 
         uint32_t magic = readInt(source);
         if (magic != exportMagic)
@@ -110,14 +107,18 @@ Paths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor)
         info.deriver = readString(source);
         if (info.deriver != "") assertStorePath(info.deriver);
 
-        info.narHash = hashString(htSHA256, *tee.data);
-        info.narSize = tee.data->size();
+        auto hashResult = hashSink.finish();
+        info.narHash = hashResult.first;
+        info.narSize = hashResult.second;
 
         // Ignore optional legacy signature.
         if (readInt(source) == 1)
             readString(source);
 
-        addToStore(info, *tee.data);
+        if (lseek(fd, 0, SEEK_SET) == -1)
+            throw SysError(format("seeking in ‘%1%’") % narFile);
+        FdSource narSource(fd);
+        addToStore(info, narSource);
 
         // FIXME: implement accessors?
         assert(!accessor);
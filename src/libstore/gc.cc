@@ -1,10 +1,13 @@
 #include "derivations.hh"
 #include "globals.hh"
 #include "local-store.hh"
+#include "thread-pool.hh"
 
 #include <functional>
 #include <queue>
 #include <algorithm>
+#include <unordered_map>
+#include <climits>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -335,27 +338,129 @@ Roots LocalStore::findRoots()
 }
 
 
+/* Add the hash parts of the store paths that occur in ‘s’ to
+   ‘hashParts’. */
+static void findStorePathHashes(const string & s, StringSet & hashParts)
+{
+    string prefix = settings.nixStore + "/";
+    size_t pos = 0;
+    while ((pos = s.find(prefix, pos)) != string::npos) {
+        pos += prefix.size();
+        if (s.size() - pos <= storePathHashLen || s[pos + storePathHashLen] != '-') continue;
+        string hashPart(s, pos, storePathHashLen);
+        if (hashPart.find_first_not_of(base32Chars) != string::npos) continue;
+        hashParts.insert(hashPart);
+        pos += storePathHashLen;
+    }
+}
+
+
+/* Like readLink(), but for the symlinks in /proc, which have a
+   reported size of 0. Returns an empty string if the link cannot be
+   read, e.g. because the process has exited. */
+static string readProcLink(const Path & path)
+{
+    char buf[PATH_MAX];
+    ssize_t n = readlink(path.c_str(), buf, sizeof(buf));
+    return n == -1 ? "" : string(buf, n);
+}
+
+
+/* Errors that just mean that a process has gone away, or that we
+   aren't allowed to look at it. */
+static bool isProcessGone(const SysError & e)
+{
+    return e.errNo == ENOENT || e.errNo == ESRCH || e.errNo == EACCES
+        || e.errNo == EPERM || e.errNo == ENOTDIR;
+}
+
+
+/* Find the store paths used by the process with the given PID: its
+   executable, its current directory, its open files, its mapped
+   files (e.g. shared libraries) and anything mentioned in its
+   environment. */
+static void findProcessRoots(const string & pid, StringSet & hashParts)
+{
+    Path process = "/proc/" + pid;
+
+    findStorePathHashes(readProcLink(process + "/exe"), hashParts);
+    findStorePathHashes(readProcLink(process + "/cwd"), hashParts);
+
+    try {
+        for (auto & fd : readDirectory(process + "/fd"))
+            findStorePathHashes(readProcLink(process + "/fd/" + fd.name), hashParts);
+    } catch (SysError & e) {
+        if (!isProcessGone(e)) throw;
+    }
+
+    for (auto & file : {"/maps", "/environ"})
+        try {
+            findStorePathHashes(readFile(process + file, true), hashParts);
+        } catch (SysError & e) {
+            if (!isProcessGone(e)) throw;
+        }
+}
+
+
 void LocalStore::findRuntimeRoots(PathSet & roots)
 {
-    Path rootFinder = getEnv("NIX_ROOT_FINDER",
-        settings.nixLibexecDir + "/nix/find-runtime-roots.pl");
+    StringSet hashParts;
+
+    /* For backwards compatibility, an external program that prints
+       the runtime roots can be specified via NIX_ROOT_FINDER. Setting
+       it to an empty string disables runtime roots. */
+    const char * rootFinder = getenv("NIX_ROOT_FINDER");
 
-    if (rootFinder.empty()) return;
+    if (rootFinder) {
+        if (!*rootFinder) return;
+        debug(format("executing ‘%1%’ to find additional roots") % rootFinder);
+        findStorePathHashes(runProgram(rootFinder), hashParts);
+    }
 
-    debug(format("executing ‘%1%’ to find additional roots") % rootFinder);
+    else if (pathExists("/proc/self")) {
+        /* Scan the processes in parallel, since on machines with many
+           processes this can take a while, and we're holding the GC
+           lock. */
+        Sync<StringSet> hashParts_;
+        ThreadPool pool;
+
+        for (auto & ent : readDirectory("/proc")) {
+            if (ent.name.find_first_not_of("0123456789") != string::npos) continue;
+            auto pid = ent.name;
+            pool.enqueue([&hashParts_, pid]() {
+                StringSet found;
+                findProcessRoots(pid, found);
+                auto hashParts(hashParts_.lock());
+                hashParts->insert(found.begin(), found.end());
+            });
+        }
 
-    string result = runProgram(rootFinder);
+        pool.process();
 
-    StringSet paths = tokenizeString<StringSet>(result, "\n");
+        hashParts = *hashParts_.lock();
 
-    for (auto & i : paths)
-        if (isInStore(i)) {
-            Path path = toStorePath(i);
-            if (roots.find(path) == roots.end() && isStorePath(path) && isValidPath(path)) {
-                debug(format("got additional root ‘%1%’") % path);
-                roots.insert(path);
+        /* This is rather NixOS-specific. */
+        for (auto & file : {"/proc/sys/kernel/modprobe", "/proc/sys/kernel/fbsplash",
+                 "/proc/sys/kernel/poweroff_cmd"})
+            try {
+                findStorePathHashes(readFile(file, true), hashParts);
+            } catch (SysError & e) {
             }
+    }
+
+    else {
+        /* Without /proc, ask lsof for the open files. */
+        try {
+            findStorePathHashes(runProgram("lsof", true, {"-n", "-w", "-F", "n"}), hashParts);
+        } catch (Error & e) {
+            debug(format("cannot run ‘lsof’: %1%") % e.msg());
         }
+    }
+
+    /* Look up all the hash parts at once. */
+    for (auto & path : queryPathsFromHashParts(hashParts))
+        if (roots.insert(path).second)
+            debug(format("got additional root ‘%1%’") % path);
 }
 
 
@@ -376,6 +481,8 @@ struct LocalStore::GCState
     bool moveToTrash = true;
     Path trashDir;
     bool shouldDelete;
+    bool marked = false; /* whether ‘alive’ contains all live paths */
+    FDs fds; /* locked temporary root files */
     GCState(GCResults & results_) : results(results_), bytesInvalidated(0) { }
 };
 
@@ -473,6 +580,8 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
 
     visited.insert(path);
 
+    if (state.marked) return false;
+
     if (!isStorePath(path) || !isValidPath(path)) return false;
 
     PathSet incoming;
@@ -508,6 +617,123 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
 }
 
 
+/* Add all valid paths reachable from the roots to ‘state.alive’.
+   Rather than doing a depth-first search over the referrers of each
+   path in the store, which takes several SQLite queries per path
+   visited, this loads the reference graph and the derivation outputs
+   into memory at once, and marks the live paths in a single
+   traversal from the roots. */
+void LocalStore::markLivePaths(GCState & state)
+{
+    /* Paths are identified by their index in ‘paths’. */
+    std::unordered_map<Path, uint32_t> ids;
+    std::vector<const Path *> paths;
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+
+    retrySQLite<void>([&]() {
+        auto dbState(_state.lock());
+
+        ids.clear();
+        paths.clear();
+        edges.clear();
+
+        /* Read the tables in a single transaction to get a
+           consistent snapshot. */
+        SQLiteTxn txn(dbState->db);
+
+        std::unordered_map<int64_t, uint32_t> dbIds;
+        std::vector<std::pair<uint32_t, Path>> derivers;
+
+        SQLiteStmt stmtPaths;
+        stmtPaths.create(dbState->db, "select id, path, deriver from ValidPaths;");
+        auto usePaths(stmtPaths.use());
+        while (usePaths.next()) {
+            uint32_t n = paths.size();
+            paths.push_back(&ids.emplace(usePaths.getStr(1), n).first->first);
+            dbIds[usePaths.getInt(0)] = n;
+            if (state.gcKeepDerivations && !usePaths.isNull(2))
+                derivers.emplace_back(n, usePaths.getStr(2));
+        }
+
+        const uint32_t none = -1;
+        std::vector<uint32_t> deriverOf(paths.size(), none);
+        for (auto & i : derivers) {
+            auto j = ids.find(i.second);
+            if (j != ids.end()) deriverOf[i.first] = j->second;
+        }
+
+        /* A path keeps alive the paths it references. */
+        SQLiteStmt stmtRefs;
+        stmtRefs.create(dbState->db, "select referrer, reference from Refs;");
+        auto useRefs(stmtRefs.use());
+        while (useRefs.next()) {
+            auto referrer = dbIds.find(useRefs.getInt(0));
+            auto reference = dbIds.find(useRefs.getInt(1));
+            if (referrer == dbIds.end() || reference == dbIds.end()
+                || referrer->second == reference->second) continue;
+            edges.emplace_back(referrer->second, reference->second);
+        }
+
+        /* With gc-keep-derivations, an output keeps alive the
+           derivation that built it.  With gc-keep-outputs, a
+           derivation keeps alive its outputs. */
+        if (state.gcKeepDerivations || state.gcKeepOutputs) {
+            SQLiteStmt stmtOutputs;
+            stmtOutputs.create(dbState->db, "select drv, path from DerivationOutputs;");
+            auto useOutputs(stmtOutputs.use());
+            while (useOutputs.next()) {
+                auto drv = dbIds.find(useOutputs.getInt(0));
+                auto output = ids.find(useOutputs.getStr(1));
+                if (drv == dbIds.end() || output == ids.end()
+                    || drv->second == output->second) continue;
+                if (state.gcKeepDerivations && deriverOf[output->second] == drv->second)
+                    edges.emplace_back(output->second, drv->second);
+                if (state.gcKeepOutputs)
+                    edges.emplace_back(drv->second, output->second);
+            }
+        }
+
+        txn.commit();
+    });
+
+    /* Convert the edges to adjacency lists. */
+    std::sort(edges.begin(), edges.end());
+    std::vector<uint32_t> start(paths.size() + 1, 0);
+    for (auto & i : edges) start[i.first + 1]++;
+    for (size_t i = 0; i < paths.size(); ++i) start[i + 1] += start[i];
+
+    std::vector<bool> live(paths.size(), false);
+    std::vector<uint32_t> todo;
+
+    for (auto & i : state.roots) {
+        auto j = ids.find(i);
+        if (j != ids.end() && !live[j->second]) {
+            live[j->second] = true;
+            todo.push_back(j->second);
+        }
+    }
+
+    while (!todo.empty()) {
+        auto n = todo.back();
+        todo.pop_back();
+        for (auto i = start[n]; i < start[n + 1]; ++i) {
+            auto m = edges[i].second;
+            if (!live[m]) {
+                live[m] = true;
+                todo.push_back(m);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i)
+        if (live[i]) state.alive.insert(*paths[i]);
+
+    printMsg(lvlInfo, format("found %1% live paths out of %2% valid paths") % state.alive.size() % paths.size());
+
+    state.marked = true;
+}
+
+
 void LocalStore::tryToDelete(GCState & state, const Path & path)
 {
     checkInterrupt();
@@ -542,6 +768,68 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
 }
 
 
+/* Delete the garbage among ‘invalid’ (the invalid entries in the
+   store) and ‘valid’ (the valid paths) in batches of ‘gc-batch-size’
+   paths, releasing the global GC lock between batches so that other
+   processes can add roots and paths to the store.  The dead paths are
+   determined from the snapshot of the roots obtained by the caller,
+   without holding the lock.  Since the roots and the referrers of
+   these paths may have changed by the time a batch is deleted, the
+   roots are re-read and the liveness of each path is re-checked while
+   holding the lock.  Paths deleted in a batch are moved to the trash
+   directory, which is emptied after the lock has been released. */
+void LocalStore::deleteGarbageIncremental(GCState & state,
+    AutoCloseFD & fdGCLock, const Paths & invalid, const vector<Path> & valid)
+{
+    fdGCLock.close();
+    state.fds.clear();
+
+    Paths candidates(invalid);
+
+    for (auto & i : valid) {
+        checkInterrupt();
+        PathSet visited;
+        if (!canReachRoot(state, visited, i)) candidates.push_back(i);
+    }
+
+    printMsg(lvlInfo, format("found %1% dead paths (before re-checking)") % candidates.size());
+
+    auto i = candidates.begin();
+
+    while (i != candidates.end()) {
+
+        fdGCLock = openGCLock(ltWrite);
+
+        /* Paths that became roots since the last batch were either
+           registered as permanent roots, or as temporary roots by
+           processes that we must now block. */
+        if (!state.options.ignoreLiveness)
+            for (auto & j : findRoots()) state.roots.insert(j.second);
+        readTempRoots(state.tempRoots, state.fds);
+        state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
+
+        /* A path found to be dead in a previous batch may have
+           acquired new referrers since then, so forget it, and check
+           the referrers of each path again rather than relying on
+           the marking.  Paths found to be alive stay alive. */
+        state.dead.clear();
+        state.marked = false;
+
+        for (unsigned int n = 0; n < settings.gcBatchSize && i != candidates.end(); ++n, ++i)
+            tryToDelete(state, *i);
+
+        fdGCLock.close();
+        state.fds.clear();
+
+        if (state.moveToTrash) {
+            for (auto & j : readDirectory(state.trashDir))
+                deleteGarbage(state, state.trashDir + "/" + j.name);
+            state.bytesInvalidated = 0;
+        }
+    }
+}
+
+
 /* Unlink all files in /nix/store/.links that have a link count of 1,
    which indicates that there are no other links and so they can be
    safely deleted.  FIXME: race condition with optimisePath(): we
@@ -634,8 +922,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     /* Read the temporary roots.  This acquires read locks on all
        per-process temporary root files.  So after this point no paths
        can be added to the set of temporary roots. */
-    FDs fds;
-    readTempRoots(state.tempRoots, fds);
+    readTempRoots(state.tempRoots, state.fds);
     state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
 
     /* After this point the set of roots or temporary roots cannot
@@ -668,6 +955,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     } else if (options.maxFreed > 0) {
 
+        bool incremental = state.shouldDelete && settings.gcBatchSize > 0;
+
         if (state.shouldDelete)
             printMsg(lvlError, format("deleting garbage..."));
         else
@@ -675,6 +964,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         try {
 
+            markLivePaths(state);
+
             AutoCloseDir dir = opendir(settings.nixStore.c_str());
             if (!dir) throw SysError(format("opening directory ‘%1%’") % settings.nixStore);
 
@@ -684,7 +975,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                paths, since unreachable paths could become reachable
                again.  We don't use readDirectory() here so that GCing
                can start faster. */
-            Paths entries;
+            Paths entries, invalid;
             struct dirent * dirent;
             while (errno = 0, dirent = readdir(dir)) {
                 checkInterrupt();
@@ -693,6 +984,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 Path path = settings.nixStore + "/" + name;
                 if (isStorePath(path) && isValidPath(path))
                     entries.push_back(path);
+                else if (incremental)
+                    invalid.push_back(path);
                 else
                     tryToDelete(state, path);
             }
@@ -707,8 +1000,11 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             vector<Path> entries_(entries.begin(), entries.end());
             random_shuffle(entries_.begin(), entries_.end());
 
-            for (auto & i : entries_)
-                tryToDelete(state, i);
+            if (incremental)
+                deleteGarbageIncremental(state, fdGCLock, invalid, entries_);
+            else
+                for (auto & i : entries_)
+                    tryToDelete(state, i);
 
         } catch (GCLimitReached & e) {
         }
@@ -726,7 +1022,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     /* Allow other processes to add to the store from here on. */
     fdGCLock.close();
-    fds.clear();
+    state.fds.clear();
 
     /* Delete the trash directory. */
     printMsg(lvlInfo, format("deleting ‘%1%’") % state.trashDir);
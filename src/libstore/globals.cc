@@ -29,6 +29,7 @@ Settings::Settings()
     keepGoing = false;
     tryFallback = false;
     maxBuildJobs = 1;
+    maxSubstitutionJobs = 16;
     buildCores = 1;
 #ifdef _SC_NPROCESSORS_ONLN
     long res = sysconf(_SC_NPROCESSORS_ONLN);
@@ -54,6 +55,7 @@ Settings::Settings()
     checkRootReachability = false;
     gcKeepOutputs = false;
     gcKeepDerivations = true;
+    gcBatchSize = 0;
     autoOptimiseStore = false;
     envKeepDerivations = false;
     lockCPU = getEnv("NIX_AFFINITY_HACK", "1") == "1";
@@ -158,6 +160,7 @@ void Settings::update()
 {
     _get(tryFallback, "build-fallback");
     _get(maxBuildJobs, "build-max-jobs");
+    _get(maxSubstitutionJobs, "build-max-substitution-jobs");
     _get(buildCores, "build-cores");
     _get(thisSystem, "system");
     _get(maxSilentTime, "build-max-silent-time");
@@ -176,6 +179,7 @@ void Settings::update()
     _get(checkRootReachability, "gc-check-reachability");
     _get(gcKeepOutputs, "gc-keep-outputs");
     _get(gcKeepDerivations, "gc-keep-derivations");
+    _get(gcBatchSize, "gc-batch-size");
     _get(autoOptimiseStore, "auto-optimise-store");
     _get(envKeepDerivations, "env-keep-derivations");
     _get(sshSubstituterHosts, "ssh-substituter-hosts");
@@ -88,6 +88,10 @@ struct Settings {
     /* Maximum number of parallel build jobs.  0 means unlimited. */
     unsigned int maxBuildJobs;
 
+    /* Maximum number of parallel substitutions.  These don't count
+       towards maxBuildJobs. */
+    unsigned int maxSubstitutionJobs;
+
     /* Number of CPU cores to utilize in parallel within a build,
        i.e. by passing this number to Make via '-j'. 0 means that the
        number of actual CPU cores on the local host ought to be
@@ -167,6 +171,12 @@ struct Settings {
        paths. */
     bool gcKeepDerivations;
 
+    /* The number of dead paths that the garbage collector deletes
+       before temporarily releasing the global GC lock, so that other
+       processes can add to the store in the meantime (0 means the
+       lock is held for the entire collection). */
+    unsigned int gcBatchSize;
+
     /* Whether to automatically replace files with identical contents
        with hard links. */
     bool autoOptimiseStore;
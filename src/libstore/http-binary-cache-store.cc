@@ -13,17 +13,12 @@ private:
 
     Path cacheUri;
 
-    Pool<Downloader> downloaders;
-
 public:
 
     HttpBinaryCacheStore(
         const StoreParams & params, const Path & _cacheUri)
         : BinaryCacheStore(params)
         , cacheUri(_cacheUri)
-        , downloaders(
-            std::numeric_limits<size_t>::max(),
-            []() { return makeDownloader(); })
     {
         if (cacheUri.back() == '/')
             cacheUri.pop_back();
@@ -54,11 +49,10 @@ protected:
     bool fileExists(const std::string & path) override
     {
         try {
-            auto downloader(downloaders.get());
             DownloadOptions options;
             options.showProgress = DownloadOptions::no;
             options.head = true;
-            downloader->download(cacheUri + "/" + path, options);
+            getDownloader()->download(cacheUri + "/" + path, options);
             return true;
         } catch (DownloadError & e) {
             /* S3 buckets return 403 if a file doesn't exist and the
@@ -76,11 +70,10 @@ protected:
 
     std::shared_ptr<std::string> getFile(const std::string & path) override
     {
-        auto downloader(downloaders.get());
         DownloadOptions options;
         options.showProgress = DownloadOptions::no;
         try {
-            return downloader->download(cacheUri + "/" + path, options).data;
+            return getDownloader()->download(cacheUri + "/" + path, options).data;
         } catch (DownloadError & e) {
             if (e.error == Downloader::NotFound || e.error == Downloader::Forbidden)
                 return 0;
@@ -88,6 +81,19 @@ protected:
         }
     }
 
+    void getFile(const std::string & path, Sink & sink) override
+    {
+        DownloadOptions options;
+        options.showProgress = DownloadOptions::no;
+        try {
+            getDownloader()->download(cacheUri + "/" + path, options, sink);
+        } catch (DownloadError & e) {
+            if (e.error == Downloader::NotFound || e.error == Downloader::Forbidden)
+                throw NoSuchBinaryCacheFile(format("file ‘%s’ does not exist in binary cache ‘%s’") % path % getUri());
+            throw;
+        }
+    }
+
 };
 
 static RegisterStoreImplementation regStore([](
@@ -2,6 +2,8 @@
 #include "globals.hh"
 #include "nar-info-disk-cache.hh"
 
+#include <fcntl.h>
+
 namespace nix {
 
 class LocalBinaryCacheStore : public BinaryCacheStore
@@ -37,6 +39,8 @@ protected:
 
     std::shared_ptr<std::string> getFile(const std::string & path) override;
 
+    void getFile(const std::string & path, Sink & sink) override;
+
     PathSet queryAllValidPaths() override
     {
         PathSet paths;
@@ -92,6 +96,18 @@ std::shared_ptr<std::string> LocalBinaryCacheStore::getFile(const std::string &
     }
 }
 
+void LocalBinaryCacheStore::getFile(const std::string & path, Sink & sink)
+{
+    Path p = binaryCacheDir + "/" + path;
+    AutoCloseFD fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            throw NoSuchBinaryCacheFile(format("file ‘%s’ does not exist in binary cache ‘%s’") % path % getUri());
+        throw SysError(format("opening file ‘%1%’") % p);
+    }
+    drainFD(fd, sink);
+}
+
 static RegisterStoreImplementation regStore([](
     const std::string & uri, const StoreParams & params)
     -> std::shared_ptr<Store>
@@ -6,6 +6,7 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "nar-info.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -189,7 +190,11 @@ LocalStore::LocalStore()
 
         if (curSchema < 7) { upgradeStore7(); }
 
-        openDB(*state, false);
+        /* Schema 10 only adds the OptimisedPaths table.  Since the
+           schema only creates what doesn't exist yet, let openDB()
+           apply it, so the table exists before the statements using
+           it are prepared. */
+        openDB(*state, curSchema < 10);
 
         if (curSchema < 8) {
             SQLiteTxn txn(state->db);
@@ -340,6 +345,8 @@ void LocalStore::openDB(State & state, bool create)
     state.stmtQueryPathFromHashPart.create(db,
         "select path from ValidPaths where path >= ? limit 1;");
     state.stmtQueryValidPaths.create(db, "select path from ValidPaths");
+    state.stmtUnmarkOptimised.create(db,
+        "delete from OptimisedPaths where id = (select id from ValidPaths where path = ?);");
 }
 
 
@@ -571,10 +578,7 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(storePathToHash(info.path), std::make_shared<ValidPathInfo>(info));
-    }
+    pathInfoCache.upsert(storePathToHash(info.path), std::make_shared<ValidPathInfo>(info));
 
     return id;
 }
@@ -596,45 +600,75 @@ Hash parseHashField(const Path & path, const string & s)
 
 std::shared_ptr<ValidPathInfo> LocalStore::queryPathInfoUncached(const Path & path)
 {
-    auto info = std::make_shared<ValidPathInfo>();
-    info->path = path;
-
     assertStorePath(path);
 
     return retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
         auto state(_state.lock());
+        return queryPathInfoInternal(*state, path);
+    });
+}
+
+
+void LocalStore::queryPathInfosUncached(const PathSet & paths,
+    std::map<Path, std::shared_ptr<ValidPathInfo>> & infos)
+{
+    for (auto & path : paths)
+        assertStorePath(path);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        std::map<Path, std::shared_ptr<ValidPathInfo>> infos2;
+        /* Do all the lookups in a single transaction, unless we're
+           called within one already (e.g. by topoSortPaths() from
+           registerValidPaths()). */
+        std::unique_ptr<SQLiteTxn> txn;
+        if (sqlite3_get_autocommit(state->db))
+            txn = std::unique_ptr<SQLiteTxn>(new SQLiteTxn(state->db));
+        for (auto & path : paths) {
+            auto info = queryPathInfoInternal(*state, path);
+            if (info) infos2[path] = info;
+        }
+        if (txn) txn->commit();
+        infos.insert(infos2.begin(), infos2.end());
+    });
+}
 
-        /* Get the path info. */
-        auto useQueryPathInfo(state->stmtQueryPathInfo.use()(path));
 
-        if (!useQueryPathInfo.next())
-            return std::shared_ptr<ValidPathInfo>();
+std::shared_ptr<ValidPathInfo> LocalStore::queryPathInfoInternal(State & state, const Path & path)
+{
+    /* Get the path info. */
+    auto useQueryPathInfo(state.stmtQueryPathInfo.use()(path));
 
-        info->id = useQueryPathInfo.getInt(0);
+    if (!useQueryPathInfo.next())
+        return std::shared_ptr<ValidPathInfo>();
 
-        info->narHash = parseHashField(path, useQueryPathInfo.getStr(1));
+    auto info = std::make_shared<ValidPathInfo>();
+    info->path = path;
 
-        info->registrationTime = useQueryPathInfo.getInt(2);
+    info->id = useQueryPathInfo.getInt(0);
 
-        auto s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 3);
-        if (s) info->deriver = s;
+    info->narHash = parseHashField(path, useQueryPathInfo.getStr(1));
 
-        /* Note that narSize = NULL yields 0. */
-        info->narSize = useQueryPathInfo.getInt(4);
+    info->registrationTime = useQueryPathInfo.getInt(2);
 
-        info->ultimate = useQueryPathInfo.getInt(5) == 1;
+    auto s = (const char *) sqlite3_column_text(state.stmtQueryPathInfo, 3);
+    if (s) info->deriver = s;
 
-        s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 6);
-        if (s) info->sigs = tokenizeString<StringSet>(s, " ");
+    /* Note that narSize = NULL yields 0. */
+    info->narSize = useQueryPathInfo.getInt(4);
 
-        /* Get the references. */
-        auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
+    info->ultimate = useQueryPathInfo.getInt(5) == 1;
 
-        while (useQueryReferences.next())
-            info->references.insert(useQueryReferences.getStr(0));
+    s = (const char *) sqlite3_column_text(state.stmtQueryPathInfo, 6);
+    if (s) info->sigs = tokenizeString<StringSet>(s, " ");
 
-        return info;
-    });
+    /* Get the references. */
+    auto useQueryReferences(state.stmtQueryReferences.use()(info->id));
+
+    while (useQueryReferences.next())
+        info->references.insert(useQueryReferences.getStr(0));
+
+    return info;
 }
 
 
@@ -786,18 +820,55 @@ Path LocalStore::queryPathFromHashPart(const string & hashPart)
 }
 
 
+PathSet LocalStore::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    return retrySQLite<PathSet>([&]() {
+        auto state(_state.lock());
+        PathSet res;
+        /* Do all the lookups in a single transaction. */
+        SQLiteTxn txn(state->db);
+        for (auto & hashPart : hashParts) {
+            if (hashPart.size() != storePathHashLen) throw Error("invalid hash part");
+            Path prefix = settings.nixStore + "/" + hashPart;
+            auto useQueryPathFromHashPart(state->stmtQueryPathFromHashPart.use()(prefix));
+            if (!useQueryPathFromHashPart.next()) continue;
+            const char * s = (const char *) sqlite3_column_text(state->stmtQueryPathFromHashPart, 0);
+            if (s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0)
+                res.insert(s);
+        }
+        txn.commit();
+        return res;
+    });
+}
+
+
+/* Substitute queries are latency-bound (typically an HTTP request
+   per path), so they're done in parallel. */
+static size_t substituterQueryThreads()
+{
+    return std::max(1, settings.get("binary-caches-parallel-connections", 25));
+}
+
+
 PathSet LocalStore::querySubstitutablePaths(const PathSet & paths)
 {
+    /* Ask each substituter, in order, about the paths that the
+       previous ones didn't have. Substituters answer batched queries
+       in parallel. */
     PathSet res;
     for (auto & sub : getDefaultSubstituters()) {
         if (!sub->wantMassQuery()) continue;
-        for (auto & path : paths) {
-            if (res.count(path)) continue;
-            debug(format("checking substituter ‘%s’ for path ‘%s’")
-                % sub->getUri() % path);
-            if (sub->isValidPath(path))
-                res.insert(path);
-        }
+
+        PathSet todo;
+        for (auto & path : paths)
+            if (!res.count(path)) todo.insert(path);
+        if (todo.empty()) break;
+
+        debug(format("checking substituter ‘%s’ for %d paths")
+            % sub->getUri() % todo.size());
+
+        for (auto & path : sub->queryValidPaths(todo))
+            res.insert(path);
     }
     return res;
 }
@@ -806,24 +877,40 @@ PathSet LocalStore::querySubstitutablePaths(const PathSet & paths)
 void LocalStore::querySubstitutablePathInfos(const PathSet & paths,
     SubstitutablePathInfos & infos)
 {
-    for (auto & sub : getDefaultSubstituters()) {
-        for (auto & path : paths) {
-            if (infos.count(path)) continue;
-            debug(format("checking substituter ‘%s’ for path ‘%s’")
-                % sub->getUri() % path);
-            try {
-                auto info = sub->queryPathInfo(path);
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos[path] = SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize};
-            } catch (InvalidPath) {
+    auto subs = getDefaultSubstituters();
+
+    Sync<SubstitutablePathInfos> infos_;
+
+    ThreadPool pool(substituterQueryThreads());
+
+    /* Each path is checked against the substituters in order, so the
+       first substituter that has a path wins. */
+    for (auto & path : paths) {
+        if (infos.count(path)) continue;
+        pool.enqueue([&, path]() {
+            for (auto & sub : subs) {
+                debug(format("checking substituter ‘%s’ for path ‘%s’")
+                    % sub->getUri() % path);
+                try {
+                    auto info = sub->queryPathInfo(path);
+                    auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                        std::shared_ptr<const ValidPathInfo>(info));
+                    infos_.lock()->emplace(path, SubstitutablePathInfo{
+                        info->deriver,
+                        info->references,
+                        narInfo ? narInfo->fileSize : 0,
+                        info->narSize});
+                    break;
+                } catch (InvalidPath) {
+                }
             }
-        }
+        });
     }
+
+    pool.process();
+
+    auto infos2(infos_.lock());
+    infos.insert(infos2->begin(), infos2->end());
 }
 
 
@@ -851,9 +938,13 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
 
         for (auto & i : infos) {
             assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
+            if (isValidPath_(*state, i.path)) {
                 updatePathInfo(*state, i);
-            else
+                /* The contents of the path may have been replaced
+                   (e.g. when repairing it), so it has to be
+                   optimised again. */
+                state->stmtUnmarkOptimised.use()(i.path).exec();
+            } else
                 addValidPath(*state, i, false);
             paths.insert(i.path);
         }
@@ -897,20 +988,50 @@ void LocalStore::invalidatePath(State & state, const Path & path)
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(storePathToHash(path));
-    }
+    pathInfoCache.erase(storePathToHash(path));
 }
 
 
-void LocalStore::addToStore(const ValidPathInfo & info, const std::string & nar, bool repair)
+/* Check that the NAR hashed by ‘hashSink’ matches ‘info’. */
+static void checkNarHash(const ValidPathInfo & info, HashSink & hashSink)
 {
-    Hash h = hashString(htSHA256, nar);
-    if (h != info.narHash)
+    auto hashResult = hashSink.finish();
+    if (hashResult.first != info.narHash)
         throw Error(format("hash mismatch importing path ‘%s’; expected hash ‘%s’, got ‘%s’") %
-            info.path % info.narHash.to_string() % h.to_string());
+            info.path % info.narHash.to_string() % hashResult.first.to_string());
+    if (info.narSize && hashResult.second != info.narSize)
+        throw Error(format("size mismatch importing path ‘%s’; expected %s bytes, got %s") %
+            info.path % info.narSize % hashResult.second);
+}
+
+
+void LocalStore::restoreFromNar(const ValidPathInfo & info, Source & source)
+{
+    /* Hash the NAR while it's being read, so that we never need to
+       hold it in memory. */
+    HashSink hashSink(htSHA256);
+    TeeSource wrapperSource(source, hashSink);
+
+    deletePath(info.path);
+
+    /* The path is locked and not yet valid, so it's safe to get rid
+       of it if the NAR turns out to be truncated or corrupt. */
+    try {
+        restorePath(info.path, wrapperSource);
+        checkNarHash(info, hashSink);
+    } catch (...) {
+        deletePath(info.path);
+        throw;
+    }
+
+    canonicalisePathMetaData(info.path, -1);
+
+    optimisePath(info.path); // FIXME: combine with hashPath()
+}
+
 
+void LocalStore::addToStore(const ValidPathInfo & info, Source & source, bool repair)
+{
     if (requireSigs && !info.checkSignatures(publicKeys))
         throw Error(format("cannot import path ‘%s’ because it lacks a valid signature") % info.path);
 
@@ -928,21 +1049,20 @@ void LocalStore::addToStore(const ValidPathInfo & info, const std::string & nar,
             outputLock.lockPaths({info.path});
 
         if (repair || !isValidPath(info.path)) {
-
-            deletePath(info.path);
-
-            StringSource source(nar);
-            restorePath(info.path, source);
-
-            canonicalisePathMetaData(info.path, -1);
-
-            optimisePath(info.path); // FIXME: combine with hashPath()
-
+            restoreFromNar(info, source);
             registerValidPath(info);
+            outputLock.setDeletion(true);
+            return;
         }
-
-        outputLock.setDeletion(true);
     }
+
+    /* If the path was already valid, we still have to consume the
+       NAR from the source. */
+    HashSink hashSink(htSHA256);
+    TeeSource wrapperSource(source, hashSink);
+    ParseSink sink;
+    parseDump(sink, wrapperSource);
+    checkNarHash(info, hashSink);
 }
 
 
@@ -1100,7 +1220,7 @@ void LocalStore::invalidatePathChecked(const Path & path)
 }
 
 
-bool LocalStore::verifyStore(bool checkContents, bool repair)
+bool LocalStore::verifyStore(bool checkContents, bool repair, bool resume)
 {
     printMsg(lvlError, format("reading the Nix store..."));
 
@@ -1130,44 +1250,77 @@ bool LocalStore::verifyStore(bool checkContents, bool repair)
 
         Hash nullHash(htSHA256);
 
-        for (auto & i : validPaths) {
+        /* The paths whose contents have been checked successfully are
+           recorded in a checkpoint file, so that an interrupted check
+           can be resumed.  Unless we're asked to resume, any previous
+           checkpoint is discarded.  The file is removed once all paths
+           have been checked. */
+        Path checkpointPath = settings.nixStateDir + "/verify-checkpoint";
+        PathSet checked;
+        if (resume && pathExists(checkpointPath)) {
+            checked = tokenizeString<PathSet>(readFile(checkpointPath), "\n");
+            printMsg(lvlError, format("resuming previous check; skipping %1% paths") % checked.size());
+        }
+
+        AutoCloseFD fdCheckpoint = open(checkpointPath.c_str(),
+            O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+        if (fdCheckpoint == -1)
+            throw SysError(format("opening checkpoint file ‘%1%’") % checkpointPath);
+
+        RateLimiter limiter(std::max(0, settings.get("verify-rate-limit", 0)));
+
+        struct State
+        {
+            bool errors = false;
+            PathSet corrupted;
+        };
+
+        Sync<State> state_;
+
+        auto checkPath = [&](const Path & i) {
             try {
+                checkInterrupt();
+
                 auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
 
                 /* Check the content hash (optionally - slow). */
                 printMsg(lvlTalkative, format("checking contents of ‘%1%’") % i);
-                HashResult current = hashPath(info->narHash.type, i);
+                HashSink hashSink(info->narHash.type);
+                RateLimitedSink sink(hashSink, limiter);
+                dumpPath(i, sink);
+                HashResult current = hashSink.finish();
 
                 if (info->narHash != nullHash && info->narHash != current.first) {
                     printMsg(lvlError, format("path ‘%1%’ was modified! "
                             "expected hash ‘%2%’, got ‘%3%’")
                         % i % printHash(info->narHash) % printHash(current.first));
-                    if (repair) repairPath(i); else errors = true;
-                } else {
-
-                    bool update = false;
-
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printMsg(lvlError, format("fixing missing hash on ‘%1%’") % i);
-                        info->narHash = current.first;
-                        update = true;
-                    }
-
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printMsg(lvlError, format("updating size field on ‘%1%’ to %2%") % i % current.second);
-                        info->narSize = current.second;
-                        update = true;
-                    }
-
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
-                    }
+                    state_.lock()->corrupted.insert(i);
+                    return;
+                }
+
+                bool update = false;
 
+                /* Fill in missing hashes. */
+                if (info->narHash == nullHash) {
+                    printMsg(lvlError, format("fixing missing hash on ‘%1%’") % i);
+                    info->narHash = current.first;
+                    update = true;
                 }
 
+                /* Fill in missing narSize fields (from old stores). */
+                if (info->narSize == 0) {
+                    printMsg(lvlError, format("updating size field on ‘%1%’ to %2%") % i % current.second);
+                    info->narSize = current.second;
+                    update = true;
+                }
+
+                if (update) {
+                    auto state(_state.lock());
+                    updatePathInfo(*state, *info);
+                }
+
+                writeFull(fdCheckpoint, i + "\n");
+
             } catch (Error & e) {
                 /* It's possible that the path got GC'ed, so ignore
                    errors on invalid paths. */
@@ -1175,9 +1328,29 @@ bool LocalStore::verifyStore(bool checkContents, bool repair)
                     printMsg(lvlError, format("error: %1%") % e.msg());
                 else
                     printMsg(lvlError, format("warning: %1%") % e.msg());
-                errors = true;
+                state_.lock()->errors = true;
             }
-        }
+        };
+
+        ThreadPool pool;
+
+        for (auto & i : validPaths)
+            if (!checked.count(i))
+                pool.enqueue(std::bind(checkPath, i));
+
+        pool.process();
+
+        auto state(state_.lock());
+
+        if (state->errors) errors = true;
+
+        /* Repairing a path runs a build, so do this serially. */
+        for (auto & i : state->corrupted)
+            if (repair) repairPath(i); else errors = true;
+
+        fdCheckpoint.close();
+        if (unlink(checkpointPath.c_str()) == -1)
+            throw SysError(format("removing checkpoint file ‘%1%’") % checkpointPath);
     }
 
     return errors;
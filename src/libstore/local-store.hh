@@ -17,8 +17,9 @@ namespace nix {
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
-   Nix 1.0.  Version 7 is Nix 1.3. Version 9 is 1.12. */
-const int nixSchemaVersion = 9;
+   Nix 1.0.  Version 7 is Nix 1.3. Version 9 is 1.12. Version 10 adds
+   OptimisedPaths. */
+const int nixSchemaVersion = 10;
 
 
 extern string drvsLogDir;
@@ -65,6 +66,7 @@ private:
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
         SQLiteStmt stmtQueryValidPaths;
+        SQLiteStmt stmtUnmarkOptimised;
 
         /* The file to which we write our temporary roots. */
         Path fnTempRoots;
@@ -101,6 +103,9 @@ public:
 
     std::shared_ptr<ValidPathInfo> queryPathInfoUncached(const Path & path) override;
 
+    void queryPathInfosUncached(const PathSet & paths,
+        std::map<Path, std::shared_ptr<ValidPathInfo>> & infos) override;
+
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
     PathSet queryValidDerivers(const Path & path) override;
@@ -111,14 +116,24 @@ public:
 
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    /* Return the valid paths whose hash parts are in ‘hashParts’. */
+    PathSet queryPathsFromHashParts(const StringSet & hashParts);
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
         SubstitutablePathInfos & infos) override;
 
-    void addToStore(const ValidPathInfo & info, const std::string & nar,
+    void addToStore(const ValidPathInfo & info, Source & source,
         bool repair) override;
 
+    /* Unpack the NAR serialisation of ‘info.path’ from ‘source’ into
+       the store and check it against ‘info’, without registering the
+       path as valid.  This allows the contents of a path to be
+       fetched before its references are valid.  The caller must hold
+       a lock on the path, and call registerValidPath() afterwards. */
+    void restoreFromNar(const ValidPathInfo & info, Source & source);
+
     Path addToStore(const string & name, const Path & srcPath,
         bool recursive = true, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, bool repair = false) override;
@@ -159,7 +174,7 @@ public:
     /* Optimise a single store path. */
     void optimisePath(const Path & path);
 
-    bool verifyStore(bool checkContents, bool repair) override;
+    bool verifyStore(bool checkContents, bool repair, bool resume) override;
 
     /* Register the validity of a path, i.e., that `path' exists, that
        the paths referenced by it exists, and in the case of an output
@@ -191,6 +206,8 @@ private:
 
     uint64_t queryValidPathId(State & state, const Path & path);
 
+    std::shared_ptr<ValidPathInfo> queryPathInfoInternal(State & state, const Path & path);
+
     uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
     void invalidatePath(State & state, const Path & path);
@@ -216,8 +233,13 @@ private:
 
     bool canReachRoot(GCState & state, PathSet & visited, const Path & path);
 
+    void markLivePaths(GCState & state);
+
     void deletePathRecursive(GCState & state, const Path & path);
 
+    void deleteGarbageIncremental(GCState & state, AutoCloseFD & fdGCLock,
+        const Paths & invalid, const vector<Path> & valid);
+
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
 
@@ -235,10 +257,25 @@ private:
 
     typedef std::unordered_set<ino_t> InodeHash;
 
+    /* Files that may have to be replaced by a hard link. */
+    typedef std::vector<std::pair<Path, struct stat>> FilesToLink;
+
     InodeHash loadInodeHash();
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
+    void findFilesToLink(const Path & path, const InodeHash & inodeHash, FilesToLink & files);
+    /* Replace ‘path’ by a hard link to the file in the links
+       directory with the same contents.  Returns false if this isn't
+       possible because that file has too many links. */
+    bool linkFile(OptimiseStats & stats, const Path & path,
+        const struct stat & st, const Hash & hash, InodeHash & inodeHash);
     void optimisePath_(OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
 
+    /* Return the valid paths that haven't been processed by
+       optimiseStore() yet. */
+    PathSet queryUnoptimisedPaths();
+
+    void markOptimised(const Paths & paths);
+
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const Path & path);
     void queryReferrers(State & state, const Path & path, PathSet & referrers);
@@ -18,43 +18,79 @@ Derivation Store::derivationFromPath(const Path & drvPath)
 void Store::computeFSClosure(const Path & path,
     PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
-    if (paths.find(path) != paths.end()) return;
-    paths.insert(path);
+    computeFSClosure(PathSet{path}, paths, flipDirection, includeOutputs, includeDerivers);
+}
+
 
-    PathSet edges;
+void Store::computeFSClosure(const PathSet & startPaths,
+    PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* Traverse the graph breadth-first, one frontier at a time, so
+       that we can fetch the info of all paths in a frontier in a
+       single batch rather than doing a round trip per path. */
+    PathSet frontier;
+    for (auto & path : startPaths)
+        if (paths.insert(path).second) frontier.insert(path);
 
-    if (flipDirection) {
-        queryReferrers(path, edges);
+    while (!frontier.empty()) {
 
-        if (includeOutputs) {
-            PathSet derivers = queryValidDerivers(path);
-            for (auto & i : derivers)
-                edges.insert(i);
-        }
+        PathSet edges;
 
-        if (includeDerivers && isDerivation(path)) {
-            PathSet outputs = queryDerivationOutputs(path);
-            for (auto & i : outputs)
-                if (isValidPath(i) && queryPathInfo(i)->deriver == path)
-                    edges.insert(i);
-        }
+        if (flipDirection) {
+
+            for (auto & path : frontier) {
+                queryReferrers(path, edges);
+                if (includeOutputs)
+                    for (auto & i : queryValidDerivers(path))
+                        edges.insert(i);
+            }
+
+            if (includeDerivers) {
+                std::map<Path, PathSet> outputs;
+                for (auto & path : frontier)
+                    if (isDerivation(path))
+                        for (auto & i : queryDerivationOutputs(path))
+                            outputs[i].insert(path);
+
+                PathSet outputPaths;
+                for (auto & i : outputs) outputPaths.insert(i.first);
+
+                for (auto & i : queryPathInfos(outputPaths))
+                    if (outputs[i.first].count(i.second->deriver))
+                        edges.insert(i.first);
+            }
+
+        } else {
+
+            auto infos = queryPathInfos(frontier);
+
+            PathSet maybeValid;
+
+            for (auto & path : frontier) {
+                auto i = infos.find(path);
+                if (i == infos.end())
+                    throw InvalidPath(format("path ‘%s’ is not valid") % path);
+                auto & info(i->second);
+
+                edges.insert(info->references.begin(), info->references.end());
 
-    } else {
-        auto info = queryPathInfo(path);
-        edges = info->references;
+                if (includeOutputs && isDerivation(path))
+                    for (auto & j : queryDerivationOutputs(path))
+                        maybeValid.insert(j);
 
-        if (includeOutputs && isDerivation(path)) {
-            PathSet outputs = queryDerivationOutputs(path);
-            for (auto & i : outputs)
-                if (isValidPath(i)) edges.insert(i);
+                if (includeDerivers && info->deriver != "")
+                    maybeValid.insert(info->deriver);
+            }
+
+            if (!maybeValid.empty())
+                for (auto & j : queryValidPaths(maybeValid))
+                    edges.insert(j);
         }
 
-        if (includeDerivers && isValidPath(info->deriver))
-            edges.insert(info->deriver);
+        frontier.clear();
+        for (auto & path : edges)
+            if (paths.insert(path).second) frontier.insert(path);
     }
-
-    for (auto & i : edges)
-        computeFSClosure(i, paths, flipDirection, includeOutputs, includeDerivers);
 }
 
 
@@ -177,6 +213,9 @@ Paths Store::topoSortPaths(const PathSet & paths)
     Paths sorted;
     PathSet visited, parents;
 
+    /* Fetch the references of all paths at once. */
+    auto infos = queryPathInfos(paths);
+
     std::function<void(const Path & path)> dfsVisit;
 
     dfsVisit = [&](const Path & path) {
@@ -188,10 +227,9 @@ Paths Store::topoSortPaths(const PathSet & paths)
         parents.insert(path);
 
         PathSet references;
-        try {
-            references = queryPathInfo(path)->references;
-        } catch (InvalidPath &) {
-        }
+        auto info = infos.find(path);
+        if (info != infos.end())
+            references = info->second->references;
 
         for (auto & i : references)
             /* Don't traverse into paths that don't exist.  That can
@@ -210,6 +210,68 @@ public:
             abort();
         }
     }
+
+    std::map<Path, bool> lookupNarExistence(
+        const std::string & uri, const PathSet & storePaths) override
+    {
+        auto state(_state.lock());
+
+        std::map<Path, bool> res;
+
+        auto cache = uriToInt(*state, uri);
+        auto now = time(0);
+
+        SQLiteTxn txn(state->db);
+
+        for (auto & storePath : storePaths) {
+            auto name = storePathToName(storePath);
+
+            /* A cached .narinfo implies existence, provided the name
+               matches (as in Store::queryPathInfo()). */
+            {
+                auto queryNAR(state->queryNAR.use()
+                    (cache)
+                    (storePathToHash(storePath)));
+                if (queryNAR.next() && (name == "" || queryNAR.getStr(2) == name)) {
+                    res[storePath] = true;
+                    continue;
+                }
+            }
+
+            auto queryNARExistence(state->queryNARExistence.use()
+                (cache)
+                (storePath));
+            if (!queryNARExistence.next()) continue;
+
+            bool exist = queryNARExistence.getInt(0);
+            if (!exist && queryNARExistence.getInt(1) < now - ttlNegative) continue;
+            res[storePath] = exist;
+        }
+
+        txn.commit();
+
+        return res;
+    }
+
+    void upsertNarExistence(
+        const std::string & uri, const std::map<Path, bool> & exists) override
+    {
+        auto state(_state.lock());
+
+        auto cache = uriToInt(*state, uri);
+        auto now = time(0);
+
+        SQLiteTxn txn(state->db);
+
+        for (auto & i : exists)
+            state->insertNARExistence.use()
+                (cache)
+                (i.first)
+                (i.second)
+                (now).exec();
+
+        txn.commit();
+    }
 };
 
 ref<NarInfoDiskCache> getNarInfoDiskCache()
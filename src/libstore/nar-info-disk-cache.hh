@@ -20,6 +20,18 @@ public:
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<ValidPathInfo> info) = 0;
+
+    /* Look up whether the specified store paths exist in the given
+       binary cache, using a single transaction. Paths for which
+       nothing (or only an expired negative lookup) is cached are
+       omitted from the result. */
+    virtual std::map<Path, bool> lookupNarExistence(
+        const std::string & uri, const PathSet & storePaths) = 0;
+
+    /* Record whether the specified store paths exist in the given
+       binary cache, using a single transaction. */
+    virtual void upsertNarExistence(
+        const std::string & uri, const std::map<Path, bool> & exists) = 0;
 };
 
 /* Return a singleton cache object that can be used concurrently by
@@ -3,6 +3,7 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <sys/types.h>
@@ -89,7 +90,7 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 }
 
 
-void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHash & inodeHash)
+void LocalStore::findFilesToLink(const Path & path, const InodeHash & inodeHash, FilesToLink & files)
 {
     checkInterrupt();
 
@@ -100,7 +101,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
         for (auto & i : names)
-            optimisePath_(stats, path + "/" + i, inodeHash);
+            findFilesToLink(path + "/" + i, inodeHash, files);
         return;
     }
 
@@ -126,17 +127,41 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
         return;
     }
 
-    /* Hash the file.  Note that hashPath() returns the hash over the
-       NAR serialisation, which includes the execute bit on the file.
-       Thus, executable and non-executable files with the same
-       contents *won't* be linked (which is good because otherwise the
-       permissions would be screwed up).
+    files.emplace_back(path, st);
+}
+
+
+/* Hash a file.  Note that hashPath() returns the hash over the NAR
+   serialisation, which includes the execute bit on the file.  Thus,
+   executable and non-executable files with the same contents *won't*
+   be linked (which is good because otherwise the permissions would
+   be screwed up).
 
-       Also note that if `path' is a symlink, then we're hashing the
-       contents of the symlink (i.e. the result of readlink()), not
-       the contents of the target (which may not even exist). */
+   Also note that if `path' is a symlink, then we're hashing the
+   contents of the symlink (i.e. the result of readlink()), not the
+   contents of the target (which may not even exist). */
+static Hash hashFileToLink(const Path & path)
+{
     Hash hash = hashPath(htSHA256, path).first;
     printMsg(lvlDebug, format("‘%1%’ has hash ‘%2%’") % path % printHash(hash));
+    return hash;
+}
+
+
+void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHash & inodeHash)
+{
+    FilesToLink files;
+    findFilesToLink(path, inodeHash, files);
+
+    for (auto & i : files)
+        linkFile(stats, i.first, i.second, hashFileToLink(i.first), inodeHash);
+}
+
+
+bool LocalStore::linkFile(OptimiseStats & stats, const Path & path,
+    const struct stat & st, const Hash & hash, InodeHash & inodeHash)
+{
+    checkInterrupt();
 
     /* Check if this is a known hash. */
     Path linkPath = linksDir + "/" + printHash32(hash);
@@ -146,7 +171,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
             inodeHash.insert(st.st_ino);
-            return;
+            return true;
         }
         if (errno != EEXIST)
             throw SysError(format("cannot link ‘%1%’ to ‘%2%’") % linkPath % path);
@@ -162,7 +187,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
 
     if (st.st_ino == stLink.st_ino) {
         printMsg(lvlDebug, format("‘%1%’ is already linked to ‘%2%’") % path % linkPath);
-        return;
+        return true;
     }
 
     if (st.st_size != stLink.st_size) {
@@ -193,7 +218,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
                Just shrug and ignore. */
             if (st.st_size)
                 printMsg(lvlInfo, format("‘%1%’ has maximum number of links") % linkPath);
-            return;
+            return false;
         }
         throw SysError(format("cannot link ‘%1%’ to ‘%2%’") % tempLink % linkPath);
     }
@@ -209,7 +234,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
                decreasing it again.) */
             if (st.st_size)
                 printMsg(lvlInfo, format("‘%1%’ has maximum number of links") % linkPath);
-            return;
+            return false;
         }
         throw SysError(format("cannot rename ‘%1%’ to ‘%2%’") % tempLink % path);
     }
@@ -217,19 +242,93 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
     stats.filesLinked++;
     stats.bytesFreed += st.st_size;
     stats.blocksFreed += st.st_blocks;
+
+    return true;
+}
+
+
+PathSet LocalStore::queryUnoptimisedPaths()
+{
+    return retrySQLite<PathSet>([&]() {
+        auto state(_state.lock());
+        SQLiteStmt stmt;
+        stmt.create(state->db,
+            "select path from ValidPaths where id not in (select id from OptimisedPaths);");
+        auto use(stmt.use());
+        PathSet res;
+        while (use.next()) res.insert(use.getStr(0));
+        return res;
+    });
+}
+
+
+void LocalStore::markOptimised(const Paths & paths)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        SQLiteStmt stmt;
+        stmt.create(state->db,
+            "insert or ignore into OptimisedPaths (id) select id from ValidPaths where path = ?;");
+        for (auto & i : paths)
+            stmt.use()(i).exec();
+        txn.commit();
+    });
 }
 
 
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
-    PathSet paths = queryAllValidPaths();
+    /* Paths that have been optimised previously don't need to be
+       looked at again, since their contents can't change. */
+    PathSet paths = queryUnoptimisedPaths();
+    if (paths.empty()) return;
+
     InodeHash inodeHash = loadInodeHash();
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        Activity act(*logger, lvlChatty, format("hashing files in ‘%1%’") % i);
-        optimisePath_(stats, i, inodeHash);
+    ThreadPool pool;
+
+    auto i = paths.begin();
+
+    while (i != paths.end()) {
+
+        /* Find the files in the next batch of paths that may need
+           to be linked, and the path that each of them belongs to. */
+        std::vector<Path> batch;
+        FilesToLink files;
+        std::vector<size_t> owners;
+        while (i != paths.end() && files.size() < 4096) {
+            addTempRoot(*i);
+            if (isValidPath(*i)) { /* otherwise it was GC'ed, probably */
+                Activity act(*logger, lvlChatty, format("hashing files in ‘%1%’") % *i);
+                findFilesToLink(*i, inodeHash, files);
+                owners.resize(files.size(), batch.size());
+                batch.push_back(*i);
+            }
+            ++i;
+        }
+
+        /* Hash them in parallel, since that's the expensive part. */
+        std::vector<Hash> hashes(files.size());
+        for (size_t n = 0; n < files.size(); ++n)
+            pool.enqueue([&, n]() {
+                checkInterrupt();
+                hashes[n] = hashFileToLink(files[n].first);
+            });
+        pool.process();
+
+        /* Only paths whose files could all be linked are done; the
+           others have to be looked at again next time. */
+        std::vector<bool> complete(batch.size(), true);
+        for (size_t n = 0; n < files.size(); ++n)
+            if (!linkFile(stats, files[n].first, files[n].second, hashes[n], inodeHash))
+                complete[owners[n]] = false;
+
+        Paths done;
+        for (size_t n = 0; n < batch.size(); ++n)
+            if (complete[n]) done.push_back(batch[n]);
+
+        markOptimised(done);
     }
 }
 
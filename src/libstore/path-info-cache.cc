@@ -0,0 +1,138 @@
+#include "path-info-cache.hh"
+#include "nar-info.hh"
+
+#include <algorithm>
+#include <functional>
+
+namespace nix {
+
+
+/* Roughly the memory used by a node of a std::set, std::list or
+   std::unordered_map, excluding the element. */
+static const size_t nodeOverhead = 48;
+
+
+/* Estimate the memory used by a cache entry. */
+static size_t entrySize(const std::string & hashPart, const PathInfoCache::Value & info)
+{
+    size_t n = 2 * nodeOverhead + sizeof(PathInfoCache::Value) + hashPart.size();
+
+    if (!info) return n;
+
+    auto narInfo = dynamic_cast<const NarInfo *>(&*info);
+
+    n += (narInfo ? sizeof(NarInfo) : sizeof(ValidPathInfo))
+        + info->path.size() + info->deriver.size();
+    for (auto & i : info->references)
+        n += nodeOverhead + sizeof(Path) + i.size();
+    for (auto & i : info->sigs)
+        n += nodeOverhead + sizeof(std::string) + i.size();
+
+    if (narInfo)
+        n += narInfo->url.size() + narInfo->compression.size() + narInfo->system.size();
+
+    return n;
+}
+
+
+PathInfoCache::PathInfoCache(size_t maxBytes)
+    : maxBytesPerShard(std::max(maxBytes / nrShards, (size_t) 1))
+{
+}
+
+
+Sync<PathInfoCache::Shard> & PathInfoCache::shardFor(const std::string & hashPart)
+{
+    return shards[std::hash<std::string>()(hashPart) % nrShards];
+}
+
+
+bool PathInfoCache::get(const std::string & hashPart, Value & value)
+{
+    auto shard(shardFor(hashPart).lock());
+
+    auto i = shard->entries.find(hashPart);
+    if (i == shard->entries.end()) {
+        misses++;
+        return false;
+    }
+
+    shard->lru.splice(shard->lru.end(), shard->lru, i->second.lru);
+
+    value = i->second.value;
+    hits++;
+    return true;
+}
+
+
+void PathInfoCache::upsert(const std::string & hashPart, const Value & value)
+{
+    size_t bytes = entrySize(hashPart, value);
+
+    auto shard(shardFor(hashPart).lock());
+
+    auto i = shard->entries.find(hashPart);
+    if (i != shard->entries.end()) erase(*shard, i);
+
+    /* Don't cache entries that would evict everything else. */
+    if (bytes > maxBytesPerShard) return;
+
+    /* Retire the least recently used entries. */
+    while (shard->bytes + bytes > maxBytesPerShard)
+        erase(*shard, shard->entries.find(*shard->lru.front()));
+
+    auto res = shard->entries.emplace(hashPart, Shard::Entry{value, bytes, shard->lru.end()});
+    assert(res.second);
+    res.first->second.lru = shard->lru.insert(shard->lru.end(), &res.first->first);
+    shard->bytes += bytes;
+}
+
+
+void PathInfoCache::erase(Shard & shard, std::unordered_map<std::string, Shard::Entry>::iterator i)
+{
+    shard.bytes -= i->second.bytes;
+    shard.lru.erase(i->second.lru);
+    shard.entries.erase(i);
+}
+
+
+bool PathInfoCache::erase(const std::string & hashPart)
+{
+    auto shard(shardFor(hashPart).lock());
+    auto i = shard->entries.find(hashPart);
+    if (i == shard->entries.end()) return false;
+    erase(*shard, i);
+    return true;
+}
+
+
+void PathInfoCache::clear()
+{
+    for (auto & shard_ : shards) {
+        auto shard(shard_.lock());
+        shard->entries.clear();
+        shard->lru.clear();
+        shard->bytes = 0;
+    }
+}
+
+
+size_t PathInfoCache::size()
+{
+    size_t n = 0;
+    for (auto & shard : shards)
+        n += shard.lock()->entries.size();
+    return n;
+}
+
+
+size_t PathInfoCache::bytes()
+{
+    size_t n = 0;
+    for (auto & shard : shards)
+        n += shard.lock()->bytes;
+    return n;
+}
+
+
+}
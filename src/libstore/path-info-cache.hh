@@ -0,0 +1,83 @@
+#pragma once
+
+#include "sync.hh"
+#include "types.hh"
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+namespace nix {
+
+
+struct ValidPathInfo;
+
+
+/* An in-memory cache of path info, keyed on the hash part of the
+   store path. A null value records that a path is known to be
+   invalid. The cache is split into independently locked shards, so
+   that threads looking up different paths rarely contend for the
+   same lock. Each shard is a least-recently used cache bounded by the
+   (estimated) number of bytes used by its entries. Thread-safe. */
+class PathInfoCache
+{
+public:
+
+    typedef std::shared_ptr<ValidPathInfo> Value;
+
+    PathInfoCache(size_t maxBytes);
+
+    /* Look up an entry. If it exists, store it in ‘value’, make it
+       the most recently used entry of its shard and return true. */
+    bool get(const std::string & hashPart, Value & value);
+
+    /* Insert or replace an entry, evicting the least recently used
+       entries of its shard as necessary. */
+    void upsert(const std::string & hashPart, const Value & value);
+
+    bool erase(const std::string & hashPart);
+
+    void clear();
+
+    /* The number of entries and the estimated memory used by them. */
+    size_t size();
+    size_t bytes();
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+private:
+
+    static const size_t nrShards = 16;
+
+    struct Shard
+    {
+        struct Entry
+        {
+            Value value;
+            size_t bytes;
+            std::list<const std::string *>::iterator lru;
+        };
+
+        std::unordered_map<std::string, Entry> entries;
+
+        /* The keys of ‘entries’, least recently used first. Pointers
+           to the keys stay valid when the map is rehashed. */
+        std::list<const std::string *> lru;
+
+        size_t bytes = 0;
+    };
+
+    std::array<Sync<Shard>, nrShards> shards;
+
+    size_t maxBytesPerShard;
+
+    Sync<Shard> & shardFor(const std::string & hashPart);
+
+    static void erase(Shard & shard, std::unordered_map<std::string, Shard::Entry>::iterator i);
+};
+
+
+}
@@ -1,5 +1,6 @@
 #include "pathlocks.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <cerrno>
 #include <cstdlib>
@@ -74,7 +75,7 @@ bool lockFile(int fd, LockType lockType, bool wait)
    close a descriptor, the previous lock will be closed as well.  And
    there is no way to query whether we already have a lock (F_GETLK
    only works on locks held by other processes). */
-static StringSet lockedPaths; /* !!! not thread-safe */
+static Sync<StringSet> lockedPaths_;
 
 
 PathLocks::PathLocks()
@@ -110,7 +111,7 @@ bool PathLocks::lockPaths(const PathSet & _paths,
 
         debug(format("locking path ‘%1%’") % path);
 
-        if (lockedPaths.find(lockPath) != lockedPaths.end())
+        if (lockedPaths_.lock()->count(lockPath))
             throw Error("deadlock: trying to re-acquire self-held lock");
 
         AutoCloseFD fd;
@@ -152,7 +153,7 @@ bool PathLocks::lockPaths(const PathSet & _paths,
 
         /* Use borrow so that the descriptor isn't closed. */
         fds.push_back(FDPair(fd.borrow(), lockPath));
-        lockedPaths.insert(lockPath);
+        lockedPaths_.lock()->insert(lockPath);
     }
 
     return true;
@@ -174,7 +175,7 @@ void PathLocks::unlock()
     for (auto & i : fds) {
         if (deletePaths) deleteLockFile(i.second, i.first);
 
-        lockedPaths.erase(i.second);
+        lockedPaths_.lock()->erase(i.second);
         if (close(i.first) == -1)
             printMsg(lvlError,
                 format("error (ignored): cannot close lock file on ‘%1%’") % i.second);
@@ -195,7 +196,7 @@ void PathLocks::setDeletion(bool deletePaths)
 bool pathIsLockedByMe(const Path & path)
 {
     Path lockPath = path + ".lock";
-    return lockedPaths.find(lockPath) != lockedPaths.end();
+    return lockedPaths_.lock()->count(lockPath);
 }
 
 
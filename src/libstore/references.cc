@@ -2,62 +2,264 @@
 #include "hash.hh"
 #include "util.hh"
 #include "archive.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
 
-#include <map>
 #include <cstdlib>
+#include <cstring>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const unsigned int refLength = 32; /* characters */
 
 
-static void search(const unsigned char * s, unsigned int len,
-    StringSet & hashes, StringSet & seen)
+struct Base32Table
 {
-    static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
+    bool isBase32[256];
+    unsigned char value[256];
+    Base32Table()
+    {
+        for (unsigned int i = 0; i < 256; ++i) {
+            isBase32[i] = false;
+            value[i] = 0;
+        }
+        for (unsigned int i = 0; i < base32Chars.size(); ++i) {
             isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
+            value[(unsigned char) base32Chars[i]] = i;
+        }
+    }
+};
+
+static const Base32Table & getBase32Table()
+{
+    static Base32Table table;
+    return table;
+}
+
+
+/* Return a bitmask in which bit ‘k’ is set iff s[k] is a base32
+   character, for 0 <= k < 32. */
+static inline uint32_t base32Mask(const unsigned char * s)
+{
+#if __SSE2__
+    /* The base32 alphabet is [0-9a-z] minus ‘e’, ‘o’, ‘t’ and
+       ‘u’. The range checks are done by shifting the range to the
+       bottom of the signed byte range, so that a single signed
+       comparison suffices. */
+    auto mask16 = [](__m128i v) -> uint32_t {
+        __m128i digit = _mm_cmplt_epi8(
+            _mm_sub_epi8(v, _mm_set1_epi8('0' + 128)), _mm_set1_epi8(-128 + 10));
+        __m128i lower = _mm_cmplt_epi8(
+            _mm_sub_epi8(v, _mm_set1_epi8('a' + 128)), _mm_set1_epi8(-128 + 26));
+        __m128i omitted = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('e')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('o'))),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('t')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('u'))));
+        return _mm_movemask_epi8(_mm_or_si128(digit, _mm_andnot_si128(omitted, lower)));
+    };
+    return mask16(_mm_loadu_si128((const __m128i *) s))
+        | mask16(_mm_loadu_si128((const __m128i *) (s + 16))) << 16;
+#else
+    auto & table(getBase32Table());
+    uint32_t mask = 0;
+    for (unsigned int k = 0; k < 32; ++k)
+        if (table.isBase32[s[k]]) mask |= (uint32_t) 1 << k;
+    return mask;
+#endif
+}
+
+
+/* A set of hash parts of store paths, stored as 160-bit binary keys in
+   an open-addressing hash table, so that looking up a candidate
+   doesn't need to allocate a string or do a lot of string
+   comparisons. */
+struct HashPartSet
+{
+    struct Key
+    {
+        uint64_t w[3];
+        bool operator == (const Key & other) const
+        {
+            return w[0] == other.w[0] && w[1] == other.w[1] && w[2] == other.w[2];
+        }
+    };
+
+    /* Decode the ‘refLength’ base32 characters at ‘s’, which must all
+       be valid base32 characters. Note that this doesn't yield the
+       bytes of the underlying hash; it only needs to be
+       injective. */
+    static Key decode(const unsigned char * s)
+    {
+        auto & table(getBase32Table());
+        Key key{{0, 0, 0}};
+        for (unsigned int i = 0; i < refLength; ++i)
+            key.w[i / 12] = key.w[i / 12] << 5 | table.value[s[i]];
+        return key;
     }
 
-    for (unsigned int i = 0; i + refLength <= len; ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
+    struct Slot
+    {
+        Key key;
+        size_t index; /* 0 for an empty slot, otherwise 1 + the index of the key */
+    };
+
+    std::vector<Slot> slots;
+    size_t size = 0;
+
+    HashPartSet(size_t capacity)
+    {
+        /* Keep the load factor at most 1/2. */
+        size_t n = 16;
+        while (n < 2 * capacity) n *= 2;
+        slots.resize(n, Slot{Key{{0, 0, 0}}, 0});
+    }
+
+    /* Since the keys are cryptographic hashes, any bits of the key
+       make a good hash. */
+    size_t slotFor(const Key & key) const
+    {
+        return (key.w[0] ^ key.w[2]) & (slots.size() - 1);
+    }
+
+    /* Insert the key if it's not already present, and return its
+       index. */
+    size_t insert(const Key & key)
+    {
+        assert(2 * (size + 1) <= slots.size());
+        for (size_t i = slotFor(key); ; i = (i + 1) & (slots.size() - 1))
+            if (!slots[i].index) {
+                slots[i] = Slot{key, ++size};
+                return size - 1;
+            } else if (slots[i].key == key)
+                return slots[i].index - 1;
+    }
+
+    /* Return the index of the key (in insertion order), or -1 if it's
+       not in the set. */
+    ssize_t find(const Key & key) const
+    {
+        for (size_t i = slotFor(key); ; i = (i + 1) & (slots.size() - 1))
+            if (!slots[i].index)
+                return -1;
+            else if (slots[i].key == key)
+                return slots[i].index - 1;
+    }
+};
+
+
+/* Look for the hashes in ‘hashes’ in the buffer ‘s’, marking those
+   that occur in ‘seen’. Like Boyer-Moore, this checks the last
+   character of each window first, which lets us skip ahead by a whole
+   window most of the time. Otherwise the whole window is classified
+   at once, and we skip past the last non-base32 character in it. */
+static void search(const unsigned char * s, size_t len,
+    const HashPartSet & hashes, std::vector<bool> & seen)
+{
+    static_assert(refLength == 32, "base32Mask() assumes 32-character references");
+
+    auto & table(getBase32Table());
+
+    size_t i = 0;
+
+    while (i + refLength <= len) {
+        if (!table.isBase32[s[i + refLength - 1]]) {
+            i += refLength;
+            continue;
+        }
+
+        uint32_t mask = base32Mask(s + i);
+        if (mask != 0xffffffff) {
+            i += refLength - __builtin_clz(~mask);
+            continue;
+        }
+
+        /* Found a run of base32 characters; check every window in
+           it. */
+        size_t end = i + refLength;
+        while (end < len && table.isBase32[s[end]]) ++end;
+
+        for ( ; i + refLength <= end; ++i) {
+            auto index = hashes.find(HashPartSet::decode(s + i));
+            if (index != -1 && !seen[index]) {
+                debug(format("found reference to ‘%1%’") % string((const char *) s + i, refLength));
+                seen[index] = true;
             }
-        if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.find(ref) != hashes.end()) {
-            debug(format("found reference to ‘%1%’ at offset ‘%2%’")
-                  % ref % i);
-            seen.insert(ref);
-            hashes.erase(ref);
         }
-        ++i;
+
+        i = end + 1;
     }
 }
 
 
+/* A sink that computes the SHA-256 hash of the data written to it,
+   and scans it for references. On multi-core machines, hashing is
+   done in the calling thread (since it's inherently sequential),
+   while the data is handed to a thread pool in large chunks to be
+   scanned in parallel. */
 struct RefScanSink : Sink
 {
     HashSink hashSink;
-    StringSet hashes;
-    StringSet seen;
+    const HashPartSet & hashes;
 
-    string tail;
+    bool parallel;
 
-    RefScanSink() : hashSink(htSHA256) { }
+    /* The last ‘refLength - 1’ bytes of the previously scanned data,
+       since a reference may span two fragments, followed by space
+       for the start of the next fragment. Only used when scanning in
+       the calling thread. */
+    unsigned char tail[2 * (refLength - 1)];
+    size_t tailLen = 0;
 
-    void operator () (const unsigned char * data, size_t len);
+    /* Unscanned data, starting with the last ‘refLength - 1’ bytes of
+       the previous chunk. Only used when scanning in parallel. */
+    string chunk;
+
+    const size_t chunkSize = 4 * 1024 * 1024;
+
+    /* Maximum number of bytes queued or being scanned, independent
+       of the number of cores. */
+    const size_t maxBytesInFlight = 32 * 1024 * 1024;
+
+    struct State
+    {
+        std::vector<bool> seen;
+
+        /* Number of bytes queued or being scanned, bounded to keep
+           memory usage in check. */
+        size_t bytesInFlight = 0;
+
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable chunkDone;
+
+    /* Declared last so that it's destroyed first, before the state
+       used by its work items. */
+    std::unique_ptr<ThreadPool> pool;
+
+    RefScanSink(const HashPartSet & hashes) : hashSink(htSHA256), hashes(hashes)
+    {
+        auto cores = std::thread::hardware_concurrency();
+        parallel = cores > 1;
+        state_.lock()->seen.resize(hashes.size, false);
+    }
+
+    void operator () (const unsigned char * data, size_t len) override;
+
+    void flushChunk();
+
+    std::vector<bool> finish();
 };
 
 
@@ -65,26 +267,101 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
 {
     hashSink(data, len);
 
-    /* It's possible that a reference spans the previous and current
-       fragment, so search in the concatenation of the tail of the
-       previous fragment and the start of the current fragment. */
-    string s = tail + string((const char *) data, len > refLength ? refLength : len);
-    search((const unsigned char *) s.data(), s.size(), hashes, seen);
+    if (parallel) {
+        chunk.append((const char *) data, len);
+        if (chunk.size() >= chunkSize) flushChunk();
+        return;
+    }
+
+    /* Scan the data in this thread, without copying it. References
+       spanning the previous and the current fragment are found by
+       searching the concatenation of the tail of the previous fragment
+       and the start of the current fragment. */
+    const size_t overlap = refLength - 1;
+
+    auto state(state_.lock());
+
+    size_t n = std::min(len, overlap);
+    memcpy(tail + tailLen, data, n);
+    search(tail, tailLen + n, hashes, state->seen);
+
+    if (len >= overlap) {
+        search(data, len, hashes, state->seen);
+        memcpy(tail, data + len - overlap, overlap);
+        tailLen = overlap;
+    } else {
+        tailLen += n;
+        if (tailLen > overlap) {
+            memmove(tail, tail + tailLen - overlap, overlap);
+            tailLen = overlap;
+        }
+    }
+}
+
+
+void RefScanSink::flushChunk()
+{
+    if (!pool) pool = std::unique_ptr<ThreadPool>(new ThreadPool);
+
+    auto data = std::make_shared<string>(chunk, chunk.size() - (refLength - 1));
+    std::swap(*data, chunk);
+    chunk.reserve(chunkSize + refLength);
+
+    size_t size = data->size();
 
-    search(data, len, hashes, seen);
+    {
+        auto state(state_.lock());
+        while (state->bytesInFlight && state->bytesInFlight + size > maxBytesInFlight)
+            state.wait(chunkDone);
+        state->bytesInFlight += size;
+    }
 
-    unsigned int tailLen = len <= refLength ? len : refLength;
-    tail =
-        string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen)) +
-        string((const char *) data + len - tailLen, tailLen);
+    pool->enqueue([this, data, size]() {
+        std::exception_ptr exception;
+        std::vector<bool> seen(hashes.size, false);
+        try {
+            search((const unsigned char *) data->data(), data->size(), hashes, seen);
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        auto state(state_.lock());
+        if (exception && !state->exception) state->exception = exception;
+        for (size_t i = 0; i < seen.size(); ++i)
+            if (seen[i]) state->seen[i] = true;
+        state->bytesInFlight -= size;
+        chunkDone.notify_one();
+    });
+}
+
+
+std::vector<bool> RefScanSink::finish()
+{
+    if (parallel) {
+        /* The last chunk is usually small, so scan it in this
+           thread. */
+        std::vector<bool> seen(hashes.size, false);
+        search((const unsigned char *) chunk.data(), chunk.size(), hashes, seen);
+        if (pool) pool->process();
+        auto state(state_.lock());
+        for (size_t i = 0; i < seen.size(); ++i)
+            if (seen[i]) state->seen[i] = true;
+    }
+
+    auto state(state_.lock());
+    if (state->exception) std::rethrow_exception(state->exception);
+    return state->seen;
 }
 
 
 PathSet scanForReferences(const string & path,
     const PathSet & refs, HashResult & hash)
 {
-    RefScanSink sink;
-    std::map<string, Path> backMap;
+    HashPartSet hashes(refs.size());
+
+    /* The paths for each hash part.  Normally there is one, but
+       distinct paths with the same hash part (e.g. ‘HASH-foo’ and
+       ‘HASH-bar’) are all referenced if the hash part is found. */
+    std::vector<PathSet> backMap;
 
     /* For efficiency (and a higher hit rate), just search for the
        hash part of the file name.  (This assumes that all references
@@ -96,22 +373,28 @@ PathSet scanForReferences(const string & path,
             throw Error(format("bad reference ‘%1%’") % i);
         string s = string(baseName, 0, pos);
         assert(s.size() == refLength);
-        assert(backMap.find(s) == backMap.end());
-        // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
-        backMap[s] = i;
+        /* A hash part containing non-base32 characters can never
+           match. */
+        bool valid = true;
+        for (auto c : s)
+            if (!getBase32Table().isBase32[(unsigned char) c]) valid = false;
+        if (!valid) continue;
+        size_t index = hashes.insert(HashPartSet::decode((const unsigned char *) s.data()));
+        if (index == backMap.size()) backMap.push_back(PathSet());
+        backMap[index].insert(i);
     }
 
+    RefScanSink sink(hashes);
+
     /* Look for the hashes in the NAR dump of the path. */
     dumpPath(path, sink);
 
+    auto seen = sink.finish();
+
     /* Map the hashes found back to their store paths. */
     PathSet found;
-    for (auto & i : sink.seen) {
-        std::map<string, Path>::iterator j;
-        if ((j = backMap.find(i)) == backMap.end()) abort();
-        found.insert(j->second);
-    }
+    for (size_t i = 0; i < seen.size(); ++i)
+        if (seen[i]) found.insert(backMap[i].begin(), backMap[i].end());
 
     hash = sink.hashSink.finish();
 
@@ -17,6 +17,7 @@
 #include <unistd.h>
 
 #include <cstring>
+#include <mutex>
 
 namespace nix {
 
@@ -89,6 +90,7 @@ ref<RemoteStore::Connection> RemoteStore::openConnection()
         conn->daemonVersion = readInt(conn->from);
         if (GET_PROTOCOL_MAJOR(conn->daemonVersion) != GET_PROTOCOL_MAJOR(PROTOCOL_VERSION))
             throw Error("Nix daemon protocol version not supported");
+        daemonVersion = conn->daemonVersion;
         conn->to << PROTOCOL_VERSION;
 
         if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 14) {
@@ -147,9 +149,191 @@ void RemoteStore::setOptions(ref<Connection> conn)
 }
 
 
+/* A connection to the daemon that has been switched to multiplexed
+   mode. Each request is tagged with an id, and the daemon sends the
+   replies in whatever order the requests complete. */
+struct RemoteStore::MuxConnection
+{
+    ref<Connection> conn;
+
+    std::mutex writeMutex;
+
+    struct State
+    {
+        uint64_t nextId = 1;
+
+        /* Whether some thread is reading a reply from the daemon. */
+        bool reading = false;
+
+        /* Replies that have been read, but not yet picked up by the
+           thread that sent the request. */
+        std::map<uint64_t, string> replies;
+
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    MuxConnection(ref<Connection> conn) : conn(conn) { }
+
+    bool good()
+    {
+        return conn->to.good() && conn->from.good() && !state_.lock()->exception;
+    }
+
+    /* Send a request and wait for the reply. */
+    string call(const string & request);
+};
+
+
+string RemoteStore::MuxConnection::call(const string & request)
+{
+    uint64_t id;
+    {
+        auto state(state_.lock());
+        id = state->nextId++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        conn->to << id << request;
+        conn->to.flush();
+    }
+
+    /* One of the waiting threads reads replies and hands them to the
+       threads that sent the corresponding requests, so we don't need
+       a thread that does nothing but read replies. */
+    while (true) {
+        {
+            auto state(state_.lock());
+            while (true) {
+                auto i = state->replies.find(id);
+                if (i != state->replies.end()) {
+                    auto reply = std::move(i->second);
+                    state->replies.erase(i);
+                    return reply;
+                }
+                if (state->exception) std::rethrow_exception(state->exception);
+                if (!state->reading) break;
+                state.wait(wakeup);
+            }
+            state->reading = true;
+        }
+
+        try {
+            uint64_t id2 = readLongLong(conn->from);
+            auto reply = readString(conn->from);
+            auto state(state_.lock());
+            state->reading = false;
+            state->replies[id2] = reply;
+        } catch (...) {
+            auto state(state_.lock());
+            state->reading = false;
+            state->exception = std::current_exception();
+        }
+
+        wakeup.notify_all();
+    }
+}
+
+
+/* A connection for doing a query: either a connection from the pool,
+   or a request on the multiplexed connection. In the latter case,
+   the request is buffered, and sent by processStderr(), after which
+   the reply can be read from ‘from’. */
+struct RemoteStore::QueryConnection
+{
+    std::unique_ptr<Pool<Connection>::Handle> pooled;
+    std::shared_ptr<MuxConnection> muxed;
+
+    StringSink request;
+    string reply;
+    StringSource replySource;
+
+    Sink & to;
+    Source & from;
+    unsigned int daemonVersion;
+
+    QueryConnection(Pool<Connection>::Handle && conn)
+        : pooled(new Pool<Connection>::Handle(std::move(conn)))
+        , replySource(reply)
+        , to((*pooled)->to)
+        , from((*pooled)->from)
+        , daemonVersion((*pooled)->daemonVersion)
+    { }
+
+    QueryConnection(std::shared_ptr<MuxConnection> muxed)
+        : muxed(muxed)
+        , replySource(reply)
+        , to(request)
+        , from(replySource)
+        , daemonVersion(muxed->conn->daemonVersion)
+    { }
+
+    void processStderr()
+    {
+        if (pooled) {
+            (*pooled)->processStderr();
+            return;
+        }
+
+        reply = muxed->call(*request.s);
+        request.s->clear();
+        replySource.pos = 0;
+
+        /* Queries don't read or write data through stderr, so we only
+           have to handle log messages. */
+        unsigned int msg;
+        while ((msg = readInt(from)) == STDERR_NEXT)
+            printMsg(lvlError, chomp(readString(from)));
+        if (msg == STDERR_ERROR) {
+            string error = readString(from);
+            unsigned int status = readInt(from);
+            throw Error(format("%1%") % error, status);
+        }
+        else if (msg != STDERR_LAST)
+            throw Error("protocol error processing standard error");
+    }
+};
+
+
+std::unique_ptr<RemoteStore::QueryConnection> RemoteStore::getQueryConnection()
+{
+    /* If other threads are using all open connections, send the query
+       over the multiplexed connection, rather than opening another
+       connection (and thus starting another daemon process). This
+       includes the case where the first connection is still being
+       opened, so the daemon version isn't known yet. */
+    auto version = daemonVersion.load();
+    if ((version == 0 || GET_PROTOCOL_MINOR(version) >= 20)
+        && connections->count() > 0
+        && connections->idleCount() == 0)
+    {
+        auto mux_(mux.lock());
+        if (!*mux_ || !(*mux_)->good()) {
+            auto conn = openConnection();
+            /* Daemons that don't support multiplexing get a
+               regular connection from the pool. */
+            if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 20)
+                return std::unique_ptr<QueryConnection>(new QueryConnection(connections->get()));
+            debug("opening a multiplexed connection to the daemon");
+            conn->to << wopMultiplex;
+            conn->processStderr();
+            readInt(conn->from);
+            *mux_ = std::make_shared<MuxConnection>(conn);
+        }
+        return std::unique_ptr<QueryConnection>(new QueryConnection(*mux_));
+    }
+
+    return std::unique_ptr<QueryConnection>(new QueryConnection(connections->get()));
+}
+
+
 bool RemoteStore::isValidPathUncached(const Path & path)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopIsValidPath << path;
     conn->processStderr();
     unsigned int reply = readInt(conn->from);
@@ -159,7 +343,7 @@ bool RemoteStore::isValidPathUncached(const Path & path)
 
 PathSet RemoteStore::queryValidPaths(const PathSet & paths)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 12) {
         PathSet res;
         for (auto & i : paths)
@@ -175,7 +359,7 @@ PathSet RemoteStore::queryValidPaths(const PathSet & paths)
 
 PathSet RemoteStore::queryAllValidPaths()
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryAllValidPaths;
     conn->processStderr();
     return readStorePaths<PathSet>(conn->from);
@@ -184,7 +368,7 @@ PathSet RemoteStore::queryAllValidPaths()
 
 PathSet RemoteStore::querySubstitutablePaths(const PathSet & paths)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 12) {
         PathSet res;
         for (auto & i : paths) {
@@ -206,7 +390,7 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 {
     if (paths.empty()) return;
 
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
 
     if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 3) return;
 
@@ -247,7 +431,7 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 
 std::shared_ptr<ValidPathInfo> RemoteStore::queryPathInfoUncached(const Path & path)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryPathInfo << path;
     try {
         conn->processStderr();
@@ -277,10 +461,41 @@ std::shared_ptr<ValidPathInfo> RemoteStore::queryPathInfoUncached(const Path & p
 }
 
 
+void RemoteStore::queryPathInfosUncached(const PathSet & paths,
+    std::map<Path, std::shared_ptr<ValidPathInfo>> & infos)
+{
+    {
+        auto conn(getQueryConnection());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 19) {
+            conn->to << wopQueryPathInfos << paths;
+            conn->processStderr();
+            size_t count = readInt(conn->from);
+            while (count--) {
+                auto info = std::make_shared<ValidPathInfo>();
+                info->path = readStorePath(conn->from);
+                info->deriver = readString(conn->from);
+                if (info->deriver != "") assertStorePath(info->deriver);
+                info->narHash = parseHash(htSHA256, readString(conn->from));
+                info->references = readStorePaths<PathSet>(conn->from);
+                info->registrationTime = readInt(conn->from);
+                info->narSize = readLongLong(conn->from);
+                info->ultimate = readInt(conn->from) != 0;
+                info->sigs = readStrings<StringSet>(conn->from);
+                infos[info->path] = info;
+            }
+            return;
+        }
+    }
+
+    /* Older daemons need a round trip per path. */
+    Store::queryPathInfosUncached(paths, infos);
+}
+
+
 void RemoteStore::queryReferrers(const Path & path,
     PathSet & referrers)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryReferrers << path;
     conn->processStderr();
     PathSet referrers2 = readStorePaths<PathSet>(conn->from);
@@ -290,7 +505,7 @@ void RemoteStore::queryReferrers(const Path & path,
 
 PathSet RemoteStore::queryValidDerivers(const Path & path)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryValidDerivers << path;
     conn->processStderr();
     return readStorePaths<PathSet>(conn->from);
@@ -299,7 +514,7 @@ PathSet RemoteStore::queryValidDerivers(const Path & path)
 
 PathSet RemoteStore::queryDerivationOutputs(const Path & path)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryDerivationOutputs << path;
     conn->processStderr();
     return readStorePaths<PathSet>(conn->from);
@@ -308,7 +523,7 @@ PathSet RemoteStore::queryDerivationOutputs(const Path & path)
 
 PathSet RemoteStore::queryDerivationOutputNames(const Path & path)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryDerivationOutputNames << path;
     conn->processStderr();
     return readStrings<PathSet>(conn->from);
@@ -317,7 +532,7 @@ PathSet RemoteStore::queryDerivationOutputNames(const Path & path)
 
 Path RemoteStore::queryPathFromHashPart(const string & hashPart)
 {
-    auto conn(connections->get());
+    auto conn(getQueryConnection());
     conn->to << wopQueryPathFromHashPart << hashPart;
     conn->processStderr();
     Path path = readString(conn->from);
@@ -326,9 +541,59 @@ Path RemoteStore::queryPathFromHashPart(const string & hashPart)
 }
 
 
-void RemoteStore::addToStore(const ValidPathInfo & info, const std::string & nar, bool repair)
+/* Copy exactly one NAR from ‘source’ to ‘sink’. The NAR is parsed
+   along the way, since that's the only way to tell where it ends. */
+static void copyNAR(Source & source, Sink & sink)
 {
-    throw Error("RemoteStore::addToStore() not implemented");
+    TeeSource tee(source, sink);
+    ParseSink parseSink; /* null sink; just parse the NAR */
+    parseDump(parseSink, tee);
+}
+
+
+void RemoteStore::addToStore(const ValidPathInfo & info, Source & narSource, bool repair)
+{
+    auto conn(connections->get());
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 18) {
+        /* Older daemons can only import paths in ‘nix-store --export’
+           format, which they request from us chunk by chunk. This
+           drops the signatures, and the daemon recomputes the NAR
+           hash. */
+        if (repair) throw Error("repairing is not supported when building through the Nix daemon");
+        auto source = sinkToSource([&](Sink & sink) {
+            sink << 1;
+            copyNAR(narSource, sink);
+            sink << exportMagic << info.path << info.references << info.deriver << 0 << 0;
+        });
+        conn->to << wopImportPaths;
+        conn->processStderr(0, source.get());
+        readStrings<Paths>(conn->from);
+        return;
+    }
+
+    conn->to << wopAddToStoreNar
+        << info.path << info.deriver << printHash(info.narHash)
+        << info.references << info.registrationTime << info.narSize
+        << info.ultimate << info.sigs << repair;
+
+    /* The NAR is streamed directly to the daemon, which unpacks it
+       into the store while receiving it, so neither side has to hold
+       the entire NAR in memory. */
+    try {
+        copyNAR(narSource, conn->to);
+        conn->processStderr();
+    } catch (SysError & e) {
+        /* Daemon closed while we were sending the path. Probably OOM
+           or I/O error, or it refused the path. */
+        if (e.errNo == EPIPE)
+            try {
+                conn->processStderr();
+            } catch (EndOfFile & e) { }
+        throw;
+    }
+
+    readInt(conn->from);
 }
 
 
@@ -415,6 +680,13 @@ BuildResult RemoteStore::buildDerivation(const Path & drvPath, const BasicDeriva
     unsigned int status;
     conn->from >> status >> res.errorMsg;
     res.status = (BuildResult::Status) status;
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 21) {
+        res.startTime = readLongLong(conn->from);
+        res.stopTime = readLongLong(conn->from);
+        res.cpuUser = readLongLong(conn->from);
+        res.cpuSystem = readLongLong(conn->from);
+        res.peakRSS = readLongLong(conn->from);
+    }
     return res;
 }
 
@@ -487,10 +759,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    pathInfoCache.clear();
 }
 
 
@@ -503,10 +772,14 @@ void RemoteStore::optimiseStore()
 }
 
 
-bool RemoteStore::verifyStore(bool checkContents, bool repair)
+bool RemoteStore::verifyStore(bool checkContents, bool repair, bool resume)
 {
     auto conn(connections->get());
     conn->to << wopVerifyStore << checkContents << repair;
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 22)
+        conn->to << resume;
+    else if (resume)
+        throw Error("the Nix daemon is too old to resume checking the store");
     conn->processStderr();
     return readInt(conn->from) != 0;
 }
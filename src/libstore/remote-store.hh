@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <limits>
 #include <string>
 
@@ -36,6 +37,9 @@ public:
 
     std::shared_ptr<ValidPathInfo> queryPathInfoUncached(const Path & path) override;
 
+    void queryPathInfosUncached(const PathSet & paths,
+        std::map<Path, std::shared_ptr<ValidPathInfo>> & infos) override;
+
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
     PathSet queryValidDerivers(const Path & path) override;
@@ -51,7 +55,7 @@ public:
     void querySubstitutablePathInfos(const PathSet & paths,
         SubstitutablePathInfos & infos) override;
 
-    void addToStore(const ValidPathInfo & info, const std::string & nar,
+    void addToStore(const ValidPathInfo & info, Source & narSource,
         bool repair) override;
 
     Path addToStore(const string & name, const Path & srcPath,
@@ -80,7 +84,7 @@ public:
 
     void optimiseStore() override;
 
-    bool verifyStore(bool checkContents, bool repair) override;
+    bool verifyStore(bool checkContents, bool repair, bool resume) override;
 
     void addSignatures(const Path & storePath, const StringSet & sigs) override;
 
@@ -102,6 +106,21 @@ private:
 
     ref<Connection> openConnection();
 
+    /* The protocol version of the daemon, as reported by the last
+       connection that was opened. */
+    std::atomic<unsigned int> daemonVersion{0};
+
+    struct MuxConnection;
+
+    /* A connection on which queries from many threads can be in
+       flight at the same time. Opened when needed. */
+    Sync<std::shared_ptr<MuxConnection>> mux;
+
+    struct QueryConnection;
+
+    /* Get a connection for doing a query. */
+    std::unique_ptr<QueryConnection> getQueryConnection();
+
     void setOptions(ref<Connection> conn);
 };
 
@@ -39,3 +39,11 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- Paths all of whose files have been replaced by hard links to
+-- /nix/store/.links by ‘nix-store --optimise’, so that they can be
+-- skipped the next time.
+create table if not exists OptimisedPaths (
+    id integer primary key not null,
+    foreign key (id) references ValidPaths(id) on delete cascade
+);
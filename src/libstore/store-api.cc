@@ -236,25 +236,27 @@ std::string Store::getUri()
 }
 
 
+Store::Store()
+    : pathInfoCache((size_t) std::max(1, settings.get("path-info-cache-size", 64)) << 20)
+{
+}
+
+
 bool Store::isValidPath(const Path & storePath)
 {
     auto hashPart = storePathToHash(storePath);
 
-    {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(hashPart);
-        if (res) {
-            stats.narInfoReadAverted++;
-            return *res != 0;
-        }
+    std::shared_ptr<ValidPathInfo> info;
+    if (pathInfoCache.get(hashPart, info)) {
+        stats.narInfoReadAverted++;
+        return info != 0;
     }
 
     if (diskCache) {
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(hashPart,
+            pathInfoCache.upsert(hashPart,
                 res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -271,13 +273,12 @@ ref<const ValidPathInfo> Store::queryPathInfo(const Path & storePath)
     auto hashPart = storePathToHash(storePath);
 
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(hashPart);
-        if (res) {
+        std::shared_ptr<ValidPathInfo> info;
+        if (pathInfoCache.get(hashPart, info)) {
             stats.narInfoReadAverted++;
-            if (!*res)
+            if (!info)
                 throw InvalidPath(format("path ‘%s’ is not valid") % storePath);
-            return ref<ValidPathInfo>(*res);
+            return ref<ValidPathInfo>(info);
         }
     }
 
@@ -285,8 +286,7 @@ ref<const ValidPathInfo> Store::queryPathInfo(const Path & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(hashPart,
+            pathInfoCache.upsert(hashPart,
                 res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
             if (res.first == NarInfoDiskCache::oInvalid ||
                 (res.second->path != storePath && storePathToName(storePath) != ""))
@@ -300,10 +300,7 @@ ref<const ValidPathInfo> Store::queryPathInfo(const Path & storePath)
     if (diskCache && info)
         diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(hashPart, info);
-    }
+    pathInfoCache.upsert(hashPart, info);
 
     if (!info
         || (info->path != storePath && storePathToName(storePath) != ""))
@@ -316,6 +313,70 @@ ref<const ValidPathInfo> Store::queryPathInfo(const Path & storePath)
 }
 
 
+std::map<Path, ref<const ValidPathInfo>> Store::queryPathInfos(const PathSet & paths)
+{
+    std::map<Path, ref<const ValidPathInfo>> res;
+
+    auto addResult = [&](const Path & storePath, std::shared_ptr<ValidPathInfo> info) {
+        if (info && (info->path == storePath || storePathToName(storePath) == ""))
+            res.emplace(storePath, ref<ValidPathInfo>(info));
+    };
+
+    PathSet missing;
+
+    for (auto & path : paths) {
+        std::shared_ptr<ValidPathInfo> info;
+        if (pathInfoCache.get(storePathToHash(path), info)) {
+            stats.narInfoReadAverted++;
+            addResult(path, info);
+        } else
+            missing.insert(path);
+    }
+
+    if (diskCache) {
+        for (auto i = missing.begin(); i != missing.end(); ) {
+            auto hashPart = storePathToHash(*i);
+            auto res2 = diskCache->lookupNarInfo(getUri(), hashPart);
+            if (res2.first == NarInfoDiskCache::oUnknown) { ++i; continue; }
+            stats.narInfoReadAverted++;
+            auto info = res2.first == NarInfoDiskCache::oInvalid ? 0 : res2.second;
+            pathInfoCache.upsert(hashPart, info);
+            addResult(*i, info);
+            i = missing.erase(i);
+        }
+    }
+
+    if (missing.empty()) return res;
+
+    std::map<Path, std::shared_ptr<ValidPathInfo>> infos;
+    queryPathInfosUncached(missing, infos);
+
+    for (auto & path : missing) {
+        auto hashPart = storePathToHash(path);
+        auto i = infos.find(path);
+        std::shared_ptr<ValidPathInfo> info;
+        if (i != infos.end()) info = i->second;
+        if (diskCache && info)
+            diskCache->upsertNarInfo(getUri(), hashPart, info);
+        if (!info) stats.narInfoMissing++;
+        pathInfoCache.upsert(hashPart, info);
+        addResult(path, info);
+    }
+
+    return res;
+}
+
+
+void Store::queryPathInfosUncached(const PathSet & paths,
+    std::map<Path, std::shared_ptr<ValidPathInfo>> & infos)
+{
+    for (auto & path : paths) {
+        auto info = queryPathInfoUncached(path);
+        if (info) infos[path] = info;
+    }
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -349,23 +410,33 @@ string Store::makeValidityRegistration(const PathSet & paths,
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    stats.pathInfoCacheSize = pathInfoCache.size();
+    stats.pathInfoCacheBytes = pathInfoCache.bytes();
+    stats.pathInfoCacheHits = pathInfoCache.hits.load();
+    stats.pathInfoCacheMisses = pathInfoCache.misses.load();
     return stats;
 }
 
 
+void Store::addToStore(const ValidPathInfo & info, const std::string & nar, bool repair)
+{
+    StringSource source(nar);
+    addToStore(info, source, repair);
+}
+
+
 void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
     const Path & storePath, bool repair)
 {
     auto info = srcStore->queryPathInfo(storePath);
 
-    StringSink sink;
-    srcStore->narFromPath({storePath}, sink);
+    /* Stream the NAR from the source store to the destination store,
+       rather than reading it into memory first. */
+    auto source = sinkToSource([&](Sink & sink) {
+        srcStore->narFromPath({storePath}, sink);
+    });
 
-    dstStore->addToStore(*info, *sink.s, repair);
+    dstStore->addToStore(*info, *source, repair);
 }
 
 
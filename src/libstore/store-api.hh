@@ -3,7 +3,7 @@
 #include "hash.hh"
 #include "serialise.hh"
 #include "crypto.hh"
-#include "lru-cache.hh"
+#include "path-info-cache.hh"
 #include "sync.hh"
 
 #include <atomic>
@@ -162,7 +162,15 @@ struct BuildResult
         NotDeterministic,
     } status = MiscFailure;
     std::string errorMsg;
-    //time_t startTime = 0, stopTime = 0;
+
+    /* When the build started and stopped, if it was done. */
+    time_t startTime = 0, stopTime = 0;
+
+    /* The user and system CPU time (in microseconds) and the peak
+       resident set size (in bytes) of the builder, if it ran
+       locally. */
+    uint64_t cpuUser = 0, cpuSystem = 0, peakRSS = 0;
+
     bool success() {
         return status == Built || status == Substituted || status == AlreadyValid;
     }
@@ -179,15 +187,12 @@ class Store : public std::enable_shared_from_this<Store>
 {
 protected:
 
-    struct State
-    {
-        LRUCache<std::string, std::shared_ptr<ValidPathInfo>> pathInfoCache{64 * 1024};
-    };
-
-    Sync<State> state;
+    PathInfoCache pathInfoCache;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
+    Store();
+
 public:
 
     virtual ~Store() { }
@@ -217,10 +222,23 @@ public:
        the name part of the store path. */
     ref<const ValidPathInfo> queryPathInfo(const Path & path);
 
+    /* Query information about a set of paths. Paths that are not
+       valid are omitted from the result. This is much cheaper than
+       calling queryPathInfo() on each path for stores that can answer
+       many queries at once (such as the local store and the
+       daemon). */
+    std::map<Path, ref<const ValidPathInfo>> queryPathInfos(const PathSet & paths);
+
 protected:
 
     virtual std::shared_ptr<ValidPathInfo> queryPathInfoUncached(const Path & path) = 0;
 
+    /* Add the info of the valid paths in ‘paths’ to ‘infos’. The
+       default implementation calls queryPathInfoUncached() for each
+       path. */
+    virtual void queryPathInfosUncached(const PathSet & paths,
+        std::map<Path, std::shared_ptr<ValidPathInfo>> & infos);
+
 public:
 
     /* Queries the set of incoming FS references for a store path.
@@ -255,10 +273,17 @@ public:
 
     virtual bool wantMassQuery() { return false; }
 
-    /* Import a path into the store. */
-    virtual void addToStore(const ValidPathInfo & info, const std::string & nar,
+    /* Import a path into the store. The NAR serialisation of the
+       path is read from ‘narSource’, which must yield exactly one
+       NAR. Implementations should not buffer the entire NAR in
+       memory. */
+    virtual void addToStore(const ValidPathInfo & info, Source & narSource,
         bool repair = false) = 0;
 
+    /* Like the above, but the NAR is given as a string. */
+    virtual void addToStore(const ValidPathInfo & info, const std::string & nar,
+        bool repair = false);
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -350,8 +375,10 @@ public:
     virtual void optimiseStore() = 0;
 
     /* Check the integrity of the Nix store.  Returns true if errors
-       remain. */
-    virtual bool verifyStore(bool checkContents, bool repair) = 0;
+       remain.  If ‘resume’ is set, the paths whose contents were
+       checked successfully by a previous, interrupted check are
+       skipped. */
+    virtual bool verifyStore(bool checkContents, bool repair, bool resume) = 0;
 
     /* Return an object to access files in the Nix store. */
     virtual ref<FSAccessor> getFSAccessor() = 0;
@@ -377,6 +404,13 @@ public:
         PathSet & paths, bool flipDirection = false,
         bool includeOutputs = false, bool includeDerivers = false);
 
+    /* Like computeFSClosure(), but for a set of paths. This is
+       preferable to calling computeFSClosure() for each path, since
+       the info of the paths is fetched in batches. */
+    void computeFSClosure(const PathSet & startPaths,
+        PathSet & paths, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false);
+
     /* Given a set of paths that are to be built, return the set of
        derivations that will be built, and the set of output paths
        that will be substituted. */
@@ -408,6 +442,9 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheBytes{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -19,6 +19,11 @@ struct CompressionSink : BufferedSink
 
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink);
 
+/* Return a sink that decompresses the data written to it and passes
+   the result to ‘nextSink’. finish() must be called after the last
+   write. */
+ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
+
 MakeError(UnknownCompressionMethod, Error);
 
 }
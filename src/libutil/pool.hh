@@ -146,6 +146,13 @@ public:
         auto state_(state.lock());
         return state_->idle.size() + state_->inUse;
     }
+
+    /* Return the number of instances that are not in use. */
+    unsigned int idleCount()
+    {
+        auto state_(state.lock());
+        return state_->idle.size();
+    }
 };
 
 }
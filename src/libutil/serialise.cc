@@ -1,8 +1,11 @@
 #include "serialise.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <cstring>
 #include <cerrno>
+#include <thread>
+#include <exception>
 
 
 namespace nix {
@@ -11,8 +14,10 @@ namespace nix {
 BufferedSink::~BufferedSink()
 {
     /* We can't call flush() here, because C++ for some insane reason
-       doesn't allow you to call virtual methods from a destructor. */
-    assert(!bufPos);
+       doesn't allow you to call virtual methods from a destructor.
+       It's okay to lose buffered data if we're being destroyed
+       because of an exception, however. */
+    assert(!bufPos || std::uncaught_exception());
     delete[] buffer;
 }
 
@@ -75,7 +80,8 @@ void FdSink::write(const unsigned char * data, size_t len)
     try {
         writeFull(fd, data, len);
     } catch (SysError & e) {
-        _good = true;
+        _good = false;
+        throw;
     }
 }
 
@@ -151,6 +157,122 @@ size_t StringSource::read(unsigned char * data, size_t len)
 }
 
 
+std::unique_ptr<Source> sinkToSource(std::function<void(Sink &)> fun)
+{
+    struct SinkToSource : Source
+    {
+        /* The maximum amount of data buffered between the writer and
+           the reader. */
+        const size_t maxBuffered = 256 * 1024;
+
+        struct State
+        {
+            std::string data;
+            size_t pos = 0;
+            bool done = false;
+            bool cancelled = false;
+            std::exception_ptr exception;
+        };
+
+        Sync<State> state_;
+
+        std::condition_variable wakeupReader, wakeupWriter;
+
+        std::thread thread;
+
+        struct Cancelled { };
+
+        struct WriterSink : Sink
+        {
+            SinkToSource & parent;
+            WriterSink(SinkToSource & parent) : parent(parent) { }
+            void operator () (const unsigned char * data, size_t len) override
+            {
+                while (len) {
+                    auto state(parent.state_.lock());
+                    while (!state->cancelled && state->data.size() - state->pos >= parent.maxBuffered)
+                        state.wait(parent.wakeupWriter);
+                    if (state->cancelled) throw Cancelled();
+                    state->data.erase(0, state->pos);
+                    state->pos = 0;
+                    size_t n = std::min(len, parent.maxBuffered);
+                    state->data.append((const char *) data, n);
+                    data += n; len -= n;
+                    parent.wakeupReader.notify_one();
+                }
+            }
+        };
+
+        SinkToSource(std::function<void(Sink &)> fun)
+        {
+            thread = std::thread([this, fun]() {
+                std::exception_ptr ex;
+                try {
+                    WriterSink sink(*this);
+                    fun(sink);
+                } catch (Cancelled &) {
+                } catch (...) {
+                    ex = std::current_exception();
+                }
+                auto state(state_.lock());
+                state->done = true;
+                state->exception = ex;
+                wakeupReader.notify_one();
+            });
+        }
+
+        ~SinkToSource()
+        {
+            {
+                auto state(state_.lock());
+                state->cancelled = true;
+            }
+            wakeupWriter.notify_one();
+            thread.join();
+        }
+
+        size_t read(unsigned char * data, size_t len) override
+        {
+            auto state(state_.lock());
+            while (state->pos == state->data.size() && !state->done)
+                state.wait(wakeupReader);
+            if (state->pos == state->data.size()) {
+                if (state->exception) std::rethrow_exception(state->exception);
+                throw EndOfFile("end of data reached");
+            }
+            size_t n = state->data.copy((char *) data, len, state->pos);
+            state->pos += n;
+            wakeupWriter.notify_one();
+            return n;
+        }
+    };
+
+    return std::unique_ptr<Source>(new SinkToSource(fun));
+}
+
+
+void RateLimiter::operator () (size_t len)
+{
+    if (!bytesPerSecond) return;
+
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point until;
+
+    {
+        auto next(next_.lock());
+        if (*next < now) *next = now;
+        until = *next;
+        *next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>((double) len / bytesPerSecond));
+    }
+
+    if (until > now) {
+        checkInterrupt();
+        std::this_thread::sleep_until(until);
+    }
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
@@ -2,6 +2,9 @@
 
 #include "types.hh"
 #include "util.hh"
+#include "sync.hh"
+
+#include <chrono>
 
 
 namespace nix {
@@ -137,6 +140,84 @@ struct StringSource : Source
 };
 
 
+/* Convert a function into a sink. */
+struct LambdaSink : Sink
+{
+    typedef std::function<void(const unsigned char *, size_t)> lambda_t;
+
+    lambda_t lambda;
+
+    LambdaSink(const lambda_t & lambda) : lambda(lambda) { }
+
+    void operator () (const unsigned char * data, size_t len) override
+    {
+        lambda(data, len);
+    }
+};
+
+
+/* A source that copies all data read from another source to a
+   sink. */
+struct TeeSource : Source
+{
+    Source & orig;
+    Sink & sink;
+    TeeSource(Source & orig, Sink & sink) : orig(orig), sink(sink) { }
+    size_t read(unsigned char * data, size_t len) override
+    {
+        size_t n = orig.read(data, len);
+        sink(data, n);
+        return n;
+    }
+};
+
+
+/* Limits the rate at which data is processed, e.g. to keep an
+   expensive background operation from saturating the disk.  A single
+   limiter can be shared between threads, in which case the limit
+   applies to their combined rate. */
+struct RateLimiter
+{
+    /* A rate of 0 means no limit. */
+    RateLimiter(uint64_t bytesPerSecond) : bytesPerSecond(bytesPerSecond) { }
+
+    /* Block until ‘len’ more bytes may be processed. */
+    void operator () (size_t len);
+
+private:
+    uint64_t bytesPerSecond;
+
+    /* The time at which the data processed so far is allowed to have
+       been processed. */
+    Sync<std::chrono::steady_clock::time_point> next_;
+};
+
+
+/* A sink that forwards data to another sink, at a rate limited by a
+   RateLimiter. */
+struct RateLimitedSink : Sink
+{
+    Sink & sink;
+    RateLimiter & limiter;
+    RateLimitedSink(Sink & sink, RateLimiter & limiter) : sink(sink), limiter(limiter) { }
+    void operator () (const unsigned char * data, size_t len) override
+    {
+        limiter(len);
+        sink(data, len);
+    }
+};
+
+
+/* Convert a function that writes to a sink into a source. The
+   function is run in a separate thread, and is blocked whenever more
+   than a small, fixed amount of data is waiting to be read, so memory
+   usage does not depend on the amount of data produced. Exceptions
+   thrown by the function are rethrown by read(). If the source is
+   destroyed before all data has been read, the function is
+   interrupted. */
+std::unique_ptr<Source> sinkToSource(std::function<void(Sink &)> fun);
+
+
 void writePadding(size_t len, Sink & sink);
 void writeString(const unsigned char * buf, size_t len, Sink & sink);
 
@@ -2,8 +2,12 @@
 
 #include "util.hh"
 #include "affinity.hh"
+#include "serialise.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
+#include <atomic>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -220,14 +224,11 @@ bool isLink(const Path & path)
 }
 
 
-DirEntries readDirectory(const Path & path)
+static DirEntries readDirectory(DIR * dir, const Path & path)
 {
     DirEntries entries;
     entries.reserve(64);
 
-    AutoCloseDir dir = opendir(path.c_str());
-    if (!dir) throw SysError(format("opening directory ‘%1%’") % path);
-
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir)) { /* sic */
         checkInterrupt();
@@ -247,6 +248,15 @@ DirEntries readDirectory(const Path & path)
 }
 
 
+DirEntries readDirectory(const Path & path)
+{
+    AutoCloseDir dir = opendir(path.c_str());
+    if (!dir) throw SysError(format("opening directory ‘%1%’") % path);
+
+    return readDirectory(dir, path);
+}
+
+
 unsigned char getFileType(const Path & path)
 {
     struct stat st = lstat(path);
@@ -316,6 +326,145 @@ void writeLine(int fd, string s)
 }
 
 
+/* Recursively deletes the contents of a directory, using file
+   descriptors of the directories and the *at() system calls, so that
+   the kernel doesn't have to resolve the full path of every file.
+   Deletion starts in the calling thread; once the tree turns out to
+   be large, subdirectories are handed to a thread pool. */
+struct PathDeleter
+{
+    struct Dir
+    {
+        std::shared_ptr<Dir> parent;
+        string name; /* relative to the parent */
+        Path path;
+        AutoCloseDir dir;
+        int fd = AT_FDCWD;
+        /* The number of subdirectories that haven't been deleted yet,
+           plus one until all entries have been read. */
+        std::atomic<size_t> pending{1};
+    };
+
+    /* The number of entries to delete in the calling thread before
+       starting a thread pool. */
+    const size_t parallelThreshold = 1024;
+
+    std::atomic<unsigned long long> bytesFreed{0};
+    std::atomic<size_t> entriesSeen{0};
+
+    /* Set when deletion has failed, to make the other threads stop. */
+    std::atomic<bool> failed{false};
+
+    /* The number of directories waiting in the pool's queue, bounded
+       to limit the number of open directories. */
+    std::atomic<size_t> queued{0};
+    size_t maxQueued;
+
+    /* Declared last so that it's destroyed first, before the state
+       used by its work items. */
+    std::unique_ptr<ThreadPool> pool;
+
+    PathDeleter()
+    {
+        maxQueued = 4 * std::max(std::thread::hardware_concurrency(), 1U);
+    }
+
+    void deleteDir(std::shared_ptr<Dir> dir);
+
+    void finish(std::shared_ptr<Dir> dir);
+};
+
+
+void PathDeleter::deleteDir(std::shared_ptr<Dir> dir)
+{
+    checkInterrupt();
+
+    if (failed) return;
+
+    int fd = openat(dir->parent->fd, dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) { finish(dir); return; }
+        throw SysError(format("opening directory ‘%1%’") % dir->path);
+    }
+    dir->dir = fdopendir(fd);
+    if (!dir->dir) {
+        ::close(fd);
+        throw SysError(format("opening directory ‘%1%’") % dir->path);
+    }
+    dir->fd = fd;
+
+    for (auto & i : readDirectory(dir->dir, dir->path)) {
+        checkInterrupt();
+
+        if (failed) return;
+
+        struct stat st;
+        if (fstatat(fd, i.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (errno == ENOENT) continue;
+            throw SysError(format("getting status of ‘%1%/%2%’") % dir->path % i.name);
+        }
+
+        entriesSeen++;
+
+        if (S_ISDIR(st.st_mode)) {
+            bytesFreed += st.st_blocks * 512;
+
+            /* Make the directory writable. */
+            if (!(st.st_mode & S_IWUSR)) {
+                if (fchmodat(fd, i.name.c_str(), st.st_mode | S_IWUSR, 0) == -1)
+                    throw SysError(format("making ‘%1%/%2%’ writable") % dir->path % i.name);
+            }
+
+            auto child = std::make_shared<Dir>();
+            child->parent = dir;
+            child->name = i.name;
+            child->path = dir->path + "/" + i.name;
+            dir->pending++;
+
+            /* Note that the pool is only created by the calling
+               thread, since there are no other threads until it
+               exists. */
+            if (!pool && entriesSeen >= parallelThreshold)
+                pool = std::unique_ptr<ThreadPool>(new ThreadPool);
+
+            if (pool && queued < maxQueued) {
+                queued++;
+                pool->enqueue([this, child]() {
+                    queued--;
+                    deleteDir(child);
+                });
+            } else
+                deleteDir(child);
+        }
+
+        else {
+            /* Files with other hard links (e.g. to /nix/store/.links)
+               don't free any space. */
+            if (st.st_nlink == 1)
+                bytesFreed += st.st_blocks * 512;
+            if (unlinkat(fd, i.name.c_str(), 0) == -1 && errno != ENOENT)
+                throw SysError(format("cannot unlink ‘%1%/%2%’") % dir->path % i.name);
+        }
+    }
+
+    finish(dir);
+}
+
+
+/* Called when ‘dir’ has been read or one of its subdirectories has
+   been deleted.  Remove it if it's now empty, and likewise for its
+   ancestors. */
+void PathDeleter::finish(std::shared_ptr<Dir> dir)
+{
+    while (dir->parent && --dir->pending == 0) {
+        if (unlinkat(dir->parent->fd, dir->name.c_str(), AT_REMOVEDIR) == -1 && errno != ENOENT)
+            throw SysError(format("cannot unlink ‘%1%’") % dir->path);
+        dir->dir.close();
+        dir = dir->parent;
+    }
+}
+
+
 static void _deletePath(const Path & path, unsigned long long & bytesFreed)
 {
     checkInterrupt();
@@ -326,24 +475,40 @@ static void _deletePath(const Path & path, unsigned long long & bytesFreed)
         throw SysError(format("getting status of ‘%1%’") % path);
     }
 
-    if (!S_ISDIR(st.st_mode) && st.st_nlink == 1)
-        bytesFreed += st.st_blocks * 512;
+    if (!S_ISDIR(st.st_mode)) {
+        if (st.st_nlink == 1)
+            bytesFreed += st.st_blocks * 512;
+        if (unlink(path.c_str()) == -1 && errno != ENOENT)
+            throw SysError(format("cannot unlink ‘%1%’") % path);
+        return;
+    }
 
-    if (S_ISDIR(st.st_mode)) {
-        /* Make the directory writable. */
-        if (!(st.st_mode & S_IWUSR)) {
-            if (chmod(path.c_str(), st.st_mode | S_IWUSR) == -1)
-                throw SysError(format("making ‘%1%’ writable") % path);
-        }
+    bytesFreed += st.st_blocks * 512;
 
-        for (auto & i : readDirectory(path))
-            _deletePath(path + "/" + i.name, bytesFreed);
+    /* Make the directory writable. */
+    if (!(st.st_mode & S_IWUSR)) {
+        if (chmod(path.c_str(), st.st_mode | S_IWUSR) == -1)
+            throw SysError(format("making ‘%1%’ writable") % path);
     }
 
-    if (remove(path.c_str()) == -1) {
-        if (errno == ENOENT) return;
-        throw SysError(format("cannot unlink ‘%1%’") % path);
+    PathDeleter deleter;
+
+    /* The parent of the top-level directory is a dummy that is never
+       removed; the top-level directory is resolved relative to the
+       current directory. */
+    auto dir = std::make_shared<PathDeleter::Dir>();
+    dir->parent = std::make_shared<PathDeleter::Dir>();
+    dir->name = dir->path = path;
+
+    try {
+        deleter.deleteDir(dir);
+        if (deleter.pool) deleter.pool->process();
+    } catch (...) {
+        deleter.failed = true;
+        throw;
     }
+
+    bytesFreed += deleter.bytesFreed;
 }
 
 
@@ -510,6 +675,22 @@ string drainFD(int fd)
 }
 
 
+void drainFD(int fd, Sink & sink)
+{
+    std::vector<unsigned char> buf(65536);
+    while (1) {
+        checkInterrupt();
+        ssize_t rd = read(fd, buf.data(), buf.size());
+        if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("reading from file");
+        }
+        else if (rd == 0) break;
+        else sink(buf.data(), rd);
+    }
+}
+
+
 
 //////////////////////////////////////////////////////////////////////
 
@@ -745,12 +926,12 @@ void Pid::kill(bool quiet)
 }
 
 
-int Pid::wait(bool block)
+int Pid::wait(bool block, struct rusage * usage)
 {
     assert(pid != -1);
     while (1) {
         int status;
-        int res = waitpid(pid, &status, block ? 0 : WNOHANG);
+        int res = wait4(pid, &status, block ? 0 : WNOHANG, usage);
         if (res == pid) {
             pid = -1;
             return status;
@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
@@ -22,6 +23,9 @@
 namespace nix {
 
 
+struct Sink;
+
+
 /* Return an environment variable. */
 string getEnv(const string & key, const string & def = "");
 
@@ -129,6 +133,8 @@ MakeError(EndOfFile, Error)
 /* Read a file descriptor until EOF occurs. */
 string drainFD(int fd);
 
+void drainFD(int fd, Sink & sink);
+
 
 
 /* Automatic cleanup of resources. */
@@ -210,7 +216,11 @@ public:
     void operator =(pid_t pid);
     operator pid_t();
     void kill(bool quiet = false);
-    int wait(bool block);
+    /* Wait for the process to exit, and return its exit status (or -1
+       if ‘block’ is false and it hasn't exited yet). If ‘usage’ is
+       set, it receives the resources used by the process and its
+       waited-for descendants. */
+    int wait(bool block, struct rusage * usage = 0);
     void setSeparatePG(bool separatePG);
     void setKillSignal(int signal);
 };
@@ -9,11 +9,15 @@
 #include "globals.hh"
 #include "monitor-fd.hh"
 #include "derivations.hh"
+#include "thread-pool.hh"
 
 #include <algorithm>
+#include <mutex>
+#include <thread>
 
 #include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -31,10 +35,21 @@
 using namespace nix;
 
 
-static FdSource from(STDIN_FILENO);
-static FdSink to(STDOUT_FILENO);
+/* The connection to the client. These are per-thread because a
+   threaded daemon processes each connection in its own thread. */
+static thread_local FdSource from(STDIN_FILENO);
+static thread_local FdSink to(STDOUT_FILENO);
 
-static bool canSendStderr;
+/* Where stderr messages and the result of the current operation go.
+   This is ‘to’, except in the threads that process multiplexed
+   requests, which collect each reply in a buffer. */
+static thread_local BufferedSink * replySink = &to;
+
+static thread_local bool canSendStderr;
+
+/* The file descriptor from which a daemon process started with
+   ‘--resume-connection’ reads the state of the connection. */
+static const int handoverFD = 3;
 
 static Logger * defaultLogger;
 
@@ -50,8 +65,8 @@ class TunnelLogger : public Logger
 
         if (canSendStderr) {
             try {
-                to << STDERR_NEXT << (fs.s + "\n");
-                to.flush();
+                *replySink << STDERR_NEXT << (fs.s + "\n");
+                replySink->flush();
             } catch (...) {
                 /* Write failed; that means that the other side is
                    gone. */
@@ -88,10 +103,10 @@ static void stopWork(bool success = true, const string & msg = "", unsigned int
     canSendStderr = false;
 
     if (success)
-        to << STDERR_LAST;
+        *replySink << STDERR_LAST;
     else {
-        to << STDERR_ERROR << msg;
-        if (status != 0) to << status;
+        *replySink << STDERR_ERROR << msg;
+        if (status != 0) *replySink << status;
     }
 }
 
@@ -123,6 +138,17 @@ struct TunnelSource : BufferedSource
 };
 
 
+/* A sink that collects the reply to a multiplexed request. */
+struct ReplySink : BufferedSink
+{
+    string s;
+    void write(const unsigned char * data, size_t len) override
+    {
+        s.append((const char *) data, len);
+    }
+};
+
+
 /* If the NAR archive contains a single file at top-level, then save
    the contents of the file to `s'.  Otherwise barf. */
 struct RetrieveRegularNARSink : ParseSink
@@ -164,6 +190,43 @@ struct SavingSourceAdapter : Source
 };
 
 
+/* Read the options sent by the client in a wopSetOptions request, and
+   apply them to ‘settings’ and ‘verbosity’. */
+static void readOptions(Source & from, unsigned int clientVersion, bool trusted,
+    Settings & settings, Verbosity & verbosity)
+{
+    settings.keepFailed = readInt(from) != 0;
+    settings.keepGoing = readInt(from) != 0;
+    settings.set("build-fallback", readInt(from) ? "true" : "false");
+    verbosity = (Verbosity) readInt(from);
+    settings.set("build-max-jobs", std::to_string(readInt(from)));
+    settings.set("build-max-silent-time", std::to_string(readInt(from)));
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 2)
+        settings.useBuildHook = readInt(from) != 0;
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 4) {
+        settings.verboseBuild = lvlError == (Verbosity) readInt(from);
+        readInt(from); // obsolete logType
+        readInt(from); // obsolete printBuildTrace
+    }
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 6)
+        settings.set("build-cores", std::to_string(readInt(from)));
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 10)
+        settings.set("build-use-substitutes", readInt(from) ? "true" : "false");
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
+        unsigned int n = readInt(from);
+        for (unsigned int i = 0; i < n; i++) {
+            string name = readString(from);
+            string value = readString(from);
+            if (name == "build-timeout" || name == "use-ssh-substituter")
+                settings.set(name, value);
+            else
+                settings.set(trusted ? name : "untrusted-" + name, value);
+        }
+    }
+    settings.update();
+}
+
+
 static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVersion,
     Source & from, Sink & to, unsigned int op)
 {
@@ -360,6 +423,8 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
         auto res = store->buildDerivation(drvPath, drv, buildMode);
         stopWork();
         to << res.status << res.errorMsg;
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 21)
+            to << res.startTime << res.stopTime << res.cpuUser << res.cpuSystem << res.peakRSS;
         break;
     }
 
@@ -434,40 +499,11 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
         break;
     }
 
-    case wopSetOptions: {
-        settings.keepFailed = readInt(from) != 0;
-        settings.keepGoing = readInt(from) != 0;
-        settings.set("build-fallback", readInt(from) ? "true" : "false");
-        verbosity = (Verbosity) readInt(from);
-        settings.set("build-max-jobs", std::to_string(readInt(from)));
-        settings.set("build-max-silent-time", std::to_string(readInt(from)));
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 2)
-            settings.useBuildHook = readInt(from) != 0;
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 4) {
-            settings.verboseBuild = lvlError == (Verbosity) readInt(from);
-            readInt(from); // obsolete logType
-            readInt(from); // obsolete printBuildTrace
-        }
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 6)
-            settings.set("build-cores", std::to_string(readInt(from)));
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 10)
-            settings.set("build-use-substitutes", readInt(from) ? "true" : "false");
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
-            unsigned int n = readInt(from);
-            for (unsigned int i = 0; i < n; i++) {
-                string name = readString(from);
-                string value = readString(from);
-                if (name == "build-timeout" || name == "use-ssh-substituter")
-                    settings.set(name, value);
-                else
-                    settings.set(trusted ? name : "untrusted-" + name, value);
-            }
-        }
-        settings.update();
+    case wopSetOptions:
+        readOptions(from, clientVersion, trusted, settings, verbosity);
         startWork();
         stopWork();
         break;
-    }
 
     case wopQuerySubstitutablePathInfo: {
         Path path = absPath(readString(from));
@@ -534,6 +570,19 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
         break;
     }
 
+    case wopQueryPathInfos: {
+        PathSet paths = readStorePaths<PathSet>(from);
+        startWork();
+        auto infos = store->queryPathInfos(paths);
+        stopWork();
+        to << infos.size();
+        for (auto & i : infos)
+            to << i.second->path << i.second->deriver << printHash(i.second->narHash)
+               << i.second->references << i.second->registrationTime << i.second->narSize
+               << i.second->ultimate << i.second->sigs;
+        break;
+    }
+
     case wopOptimiseStore:
         startWork();
         store->optimiseStore();
@@ -544,10 +593,11 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
     case wopVerifyStore: {
         bool checkContents = readInt(from) != 0;
         bool repair = readInt(from) != 0;
+        bool resume = GET_PROTOCOL_MINOR(clientVersion) >= 22 ? readInt(from) != 0 : false;
         startWork();
         if (repair && !trusted)
             throw Error("you are not privileged to repair paths");
-        bool errors = store->verifyStore(checkContents, repair);
+        bool errors = store->verifyStore(checkContents, repair, resume);
         stopWork();
         to << errors;
         break;
@@ -565,19 +615,295 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
         break;
     }
 
+    case wopAddToStoreNar: {
+        ValidPathInfo info;
+        info.path = readStorePath(from);
+        info.deriver = readString(from);
+        if (!info.deriver.empty()) assertStorePath(info.deriver);
+        info.narHash = parseHash(htSHA256, readString(from));
+        info.references = readStorePaths<PathSet>(from);
+        info.registrationTime = readInt(from);
+        info.narSize = readLongLong(from);
+        info.ultimate = readInt(from) != 0;
+        info.sigs = readStrings<StringSet>(from);
+        bool repair = readInt(from) != 0;
+        /* Only trusted users can claim that a path was built
+           locally. */
+        if (!trusted) info.ultimate = false;
+        startWork();
+        if (repair && !trusted) {
+            /* Skip over the NAR so that the connection stays in
+               sync. */
+            ParseSink sink;
+            parseDump(sink, from);
+            throw Error("you are not privileged to repair paths");
+        }
+        try {
+            store->addToStore(info, from, repair);
+        } catch (Error & e) {
+            /* We may not have read all of the NAR, in which case the
+               rest of the connection is garbage. */
+            canSendStderr = false;
+            throw;
+        }
+        stopWork();
+        to << 1;
+        break;
+    }
+
     default:
         throw Error(format("invalid operation %1%") % op);
     }
 }
 
 
-static void processConnection(bool trusted)
+/* Whether an operation may be sent over a multiplexed connection.
+   Only queries are allowed: they don't stream data to or from the
+   client, and they can safely run concurrently. */
+static bool isMultiplexable(unsigned int op)
 {
-    MonitorFdHup monitor(from.fd);
+    switch (op) {
+    case wopIsValidPath:
+    case wopQueryValidPaths:
+    case wopQueryAllValidPaths:
+    case wopQueryPathInfo:
+    case wopQueryPathInfos:
+    case wopQueryReferrers:
+    case wopQueryValidDerivers:
+    case wopQueryDerivationOutputs:
+    case wopQueryDerivationOutputNames:
+    case wopQueryPathFromHashPart:
+    case wopQuerySubstitutablePaths:
+    case wopQuerySubstitutablePathInfos:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/* Process requests on a connection that has been switched to
+   multiplexed mode. Each request consists of a request id and a
+   string containing the operation and its arguments. Requests are
+   processed concurrently by a thread pool, and each reply is sent as
+   the request id followed by a string containing what we would
+   otherwise have sent for the operation (i.e. stderr messages and the
+   result). Replies are therefore not necessarily sent in the order
+   of the requests. */
+static void processMultiplexed(ref<LocalStore> store, bool trusted, unsigned int clientVersion)
+{
+    std::mutex toMutex;
+
+    /* ‘to’ is per-thread, so the pool threads must write replies to
+       this thread's connection explicitly. */
+    FdSink & conn(to);
+
+    ThreadPool pool;
+
+    while (true) {
+        uint64_t id;
+        try {
+            id = readLongLong(from);
+        } catch (Interrupted & e) {
+            break;
+        } catch (EndOfFile & e) {
+            break;
+        }
+
+        auto request = std::make_shared<string>(readString(from));
+
+        pool.enqueue([=, &toMutex, &conn]() {
+            ReplySink reply;
+            replySink = &reply;
+
+            try {
+                StringSource source(*request);
+                unsigned int op = readInt(source);
+                if (!isMultiplexable(op))
+                    throw Error(format("operation %1% cannot be multiplexed") % op);
+                performOp(store, trusted, clientVersion, source, reply, op);
+            } catch (Error & e) {
+                stopWork(false, e.msg(), e.status);
+            } catch (std::bad_alloc & e) {
+                stopWork(false, "Nix daemon out of memory", 1);
+            }
+
+            assert(!canSendStderr);
+            replySink = &to;
+            reply.flush();
+
+            std::lock_guard<std::mutex> lock(toMutex);
+            conn << id << reply.s;
+            conn.flush();
+        });
+    }
+
+    pool.process();
+}
+
+
+/* Operations that a threaded daemon performs in the thread that
+   handles the connection. They must not depend on the client's
+   options or change any process-wide state. */
+static bool isThreadSafe(unsigned int op)
+{
+    switch (op) {
+    case wopIsValidPath:
+    case wopQueryValidPaths:
+    case wopQueryAllValidPaths:
+    case wopQueryPathInfo:
+    case wopQueryPathInfos:
+    case wopQueryReferrers:
+    case wopQueryValidDerivers:
+    case wopQueryDerivationOutputs:
+    case wopQueryDerivationOutputNames:
+    case wopQueryPathFromHashPart:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static void processOps(ref<LocalStore> store, bool trusted, unsigned int clientVersion,
+    string * savedOptions, int pendingOp = -1);
+
+
+/* Hand the connection over to a new daemon process (see
+   resumeConnection()), which performs ‘op’ and all subsequent
+   operations, so that builds and the like are isolated from the
+   other connections. We can't just fork, because the child couldn't
+   safely use SQLite or any locks held by other threads. */
+static void handOff(bool trusted, unsigned int clientVersion,
+    const string & savedOptions, WorkerOp op)
+{
+    printMsg(lvlDebug, format("handing over the connection to a new process for operation %1%") % op);
+
+    Pipe handover;
+    handover.create();
+
+    Path program = settings.nixBinDir + "/nix-daemon";
+
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon error: ";
+    options.dieWithParent = false;
+    options.allowVfork = false;
+    startProcess([&]() {
+        if (dup2(from.fd, STDIN_FILENO) == -1 || dup2(from.fd, STDOUT_FILENO) == -1)
+            throw SysError("dupping connection");
+        if (handover.readSide == handoverFD)
+            fcntl(handoverFD, F_SETFD, 0);
+        else if (dup2(handover.readSide, handoverFD) == -1)
+            throw SysError("dupping handover pipe");
+        execl(program.c_str(), "nix-daemon", "--resume-connection", NULL);
+        throw SysError(format("executing ‘%1%’") % program);
+    }, options);
+
+    handover.readSide.close();
+
+    /* Send the state of the connection, including any data that
+       we've already read from the client. */
+    FdSink sink(handover.writeSide);
+    sink << trusted << clientVersion << savedOptions << op;
+    writeString(from.buffer + from.bufPosOut, from.bufPosIn - from.bufPosOut, sink);
+    sink.flush();
+}
+
+
+/* Process requests from the client until it closes the connection.
+   ‘savedOptions’ is set if we're a thread of a threaded daemon, in
+   which case it records the client's options. */
+static void processOps(ref<LocalStore> store, bool trusted, unsigned int clientVersion,
+    string * savedOptions, int pendingOp)
+{
+    unsigned int opCount = 0;
+
+    while (true) {
+        WorkerOp op;
+        if (pendingOp != -1) {
+            op = (WorkerOp) pendingOp;
+            pendingOp = -1;
+        } else {
+            try {
+                op = (WorkerOp) readInt(from);
+            } catch (Interrupted & e) {
+                break;
+            } catch (EndOfFile & e) {
+                break;
+            }
+        }
+
+        opCount++;
+
+        if (savedOptions) {
+            if (op == wopSetOptions) {
+                /* The options must not affect other connections, so
+                   just save them for the process that takes over
+                   this connection. */
+                StringSink saved;
+                TeeSource tee(from, saved);
+                Settings settings_(settings);
+                Verbosity verbosity_;
+                readOptions(tee, clientVersion, trusted, settings_, verbosity_);
+                *savedOptions = *saved.s;
+                startWork();
+                stopWork();
+                to.flush();
+                continue;
+            }
+            if (!isThreadSafe(op)) {
+                handOff(trusted, clientVersion, *savedOptions, op);
+                break;
+            }
+        }
+
+        if (op == wopMultiplex) {
+            if (GET_PROTOCOL_MINOR(clientVersion) < 20)
+                throw Error("multiplexing is not supported by this client");
+            stopWork();
+            to << 1;
+            to.flush();
+            processMultiplexed(store, trusted, clientVersion);
+            break;
+        }
+
+        try {
+            performOp(store, trusted, clientVersion, from, to, op);
+        } catch (Error & e) {
+            /* If we're not in a state where we can send replies, then
+               something went wrong processing the input of the
+               client.  This can happen especially if I/O errors occur
+               during addTextToStore() / importPath().  If that
+               happens, just send the error message and exit. */
+            bool errorAllowed = canSendStderr;
+            stopWork(false, e.msg(), GET_PROTOCOL_MINOR(clientVersion) >= 8 ? e.status : 0);
+            if (!errorAllowed) throw;
+        } catch (std::bad_alloc & e) {
+            stopWork(false, "Nix daemon out of memory", GET_PROTOCOL_MINOR(clientVersion) >= 8 ? 1 : 0);
+            throw;
+        }
+
+        to.flush();
+
+        assert(!canSendStderr);
+    };
+
+    printMsg(lvlDebug, format("%1% operations") % opCount);
+}
+
+
+/* Process a connection. If ‘sharedStore’ is set, we're a thread of a
+   threaded daemon, and use that store. */
+static void processConnection(bool trusted, std::shared_ptr<LocalStore> sharedStore = 0)
+{
+    std::unique_ptr<MonitorFdHup> monitor;
+    if (!sharedStore) monitor = std::unique_ptr<MonitorFdHup>(new MonitorFdHup(from.fd));
 
     canSendStderr = false;
-    defaultLogger = logger;
-    logger = new TunnelLogger();
+    if (!defaultLogger) {
+        defaultLogger = logger;
+        logger = new TunnelLogger();
+    }
 
     /* Exchange the greeting. */
     unsigned int magic = readInt(from);
@@ -586,8 +912,11 @@ static void processConnection(bool trusted)
     to.flush();
     unsigned int clientVersion = readInt(from);
 
-    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from))
-        setAffinityTo(readInt(from));
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from)) {
+        unsigned int cpu = readInt(from);
+        /* Pinning a thread of a threaded daemon isn't useful. */
+        if (!sharedStore) setAffinityTo(cpu);
+    }
 
     if (GET_PROTOCOL_MINOR(clientVersion) >= 11)
         readInt(from); // obsolete reserveSpace
@@ -608,55 +937,68 @@ static void processConnection(bool trusted)
 #endif
 
         /* Open the store. */
-        auto store = make_ref<LocalStore>();
+        auto store = sharedStore ? ref<LocalStore>(sharedStore) : make_ref<LocalStore>();
 
         stopWork();
         to.flush();
 
         /* Process client requests. */
-        unsigned int opCount = 0;
+        if (sharedStore) {
+            string savedOptions;
+            processOps(store, trusted, clientVersion, &savedOptions);
+        } else {
+            processOps(store, trusted, clientVersion, 0);
+            _isInterrupted = false;
+        }
 
-        while (true) {
-            WorkerOp op;
-            try {
-                op = (WorkerOp) readInt(from);
-            } catch (Interrupted & e) {
-                break;
-            } catch (EndOfFile & e) {
-                break;
-            }
+        canSendStderr = false;
 
-            opCount++;
+    } catch (Error & e) {
+        stopWork(false, e.msg(), GET_PROTOCOL_MINOR(clientVersion) >= 8 ? 1 : 0);
+        to.flush();
+        return;
+    }
+}
 
-            try {
-                performOp(store, trusted, clientVersion, from, to, op);
-            } catch (Error & e) {
-                /* If we're not in a state where we can send replies, then
-                   something went wrong processing the input of the
-                   client.  This can happen especially if I/O errors occur
-                   during addTextToStore() / importPath().  If that
-                   happens, just send the error message and exit. */
-                bool errorAllowed = canSendStderr;
-                stopWork(false, e.msg(), GET_PROTOCOL_MINOR(clientVersion) >= 8 ? e.status : 0);
-                if (!errorAllowed) throw;
-            } catch (std::bad_alloc & e) {
-                stopWork(false, "Nix daemon out of memory", GET_PROTOCOL_MINOR(clientVersion) >= 8 ? 1 : 0);
-                throw;
-            }
 
-            to.flush();
+/* Take over a connection from a threaded daemon (see handOff()). */
+static void resumeConnection()
+{
+    FdSource handover(handoverFD);
+    bool trusted = readInt(handover);
+    unsigned int clientVersion = readInt(handover);
+    string savedOptions = readString(handover);
+    WorkerOp op = (WorkerOp) readInt(handover);
+    string buffered = readString(handover);
+    close(handoverFD);
+
+    if (setsid() == -1)
+        throw SysError(format("creating a new session"));
+
+    /* Put back the data that the parent had already read. */
+    if (!buffered.empty()) {
+        from.bufSize = std::max(from.bufSize, buffered.size());
+        from.buffer = new unsigned char[from.bufSize];
+        memcpy(from.buffer, buffered.data(), buffered.size());
+        from.bufPosIn = buffered.size();
+    }
 
-            assert(!canSendStderr);
-        };
+    MonitorFdHup monitor(from.fd);
 
-        canSendStderr = false;
-        _isInterrupted = false;
-        printMsg(lvlDebug, format("%1% operations") % opCount);
+    canSendStderr = false;
+    defaultLogger = logger;
+    logger = new TunnelLogger();
+
+    if (!savedOptions.empty()) {
+        StringSource source(savedOptions);
+        readOptions(source, clientVersion, trusted, settings, verbosity);
+    }
 
+    try {
+        processOps(make_ref<LocalStore>(), trusted, clientVersion, 0, op);
     } catch (Error & e) {
         stopWork(false, e.msg(), GET_PROTOCOL_MINOR(clientVersion) >= 8 ? 1 : 0);
         to.flush();
-        return;
     }
 }
 
@@ -808,6 +1150,17 @@ static void daemonLoop(char * * argv)
 
     closeOnExec(fdSocket);
 
+    /* In threaded mode, connections are processed by threads of this
+       process, sharing a single store (and thus its path info
+       cache). Each connection is handed over to a child process as
+       soon as it needs to do anything that isn't a simple query. */
+    std::shared_ptr<LocalStore> sharedStore;
+    if (settings.get("daemon-use-threads", false)) {
+        sharedStore = std::make_shared<LocalStore>();
+        defaultLogger = logger;
+        logger = new TunnelLogger();
+    }
+
     /* Loop accepting connections. */
     while (1) {
 
@@ -848,6 +1201,21 @@ static void daemonLoop(char * * argv)
                 % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
                 % (peer.uidKnown ? user : "<unknown>"));
 
+            if (sharedStore) {
+                int fd = remote.borrow();
+                std::thread([fd, trusted, sharedStore]() {
+                    AutoCloseFD remote(fd);
+                    try {
+                        from.fd = remote;
+                        to.fd = remote;
+                        processConnection(trusted, sharedStore);
+                    } catch (std::exception & e) {
+                        printMsg(lvlError, format("error processing connection: %1%") % e.what());
+                    }
+                }).detach();
+                continue;
+            }
+
             /* Fork a child to handle the connection. */
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -892,8 +1260,12 @@ int main(int argc, char * * argv)
     return handleExceptions(argv[0], [&]() {
         initNix();
 
+        bool resume = false;
+
         parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
-            if (*arg == "--daemon")
+            if (*arg == "--resume-connection")
+                resume = true;
+            else if (*arg == "--daemon")
                 ; /* ignored for backwards compatibility */
             else if (*arg == "--help")
                 showManPage("nix-daemon");
@@ -903,6 +1275,9 @@ int main(int argc, char * * argv)
             return true;
         });
 
-        daemonLoop(argv);
+        if (resume)
+            resumeConnection();
+        else
+            daemonLoop(argv);
     });
 }
@@ -328,19 +328,21 @@ static void opQuery(Strings opFlags, Strings opArgs)
         case qReferences:
         case qReferrers:
         case qReferrersClosure: {
-            PathSet paths;
+            PathSet args, paths;
             for (auto & i : opArgs) {
                 PathSet ps = maybeUseOutputs(followLinksToStorePath(i), useOutput, forceRealise);
-                for (auto & j : ps) {
-                    if (query == qRequisites) store->computeFSClosure(j, paths, false, includeOutputs);
-                    else if (query == qReferences) {
+                args.insert(ps.begin(), ps.end());
+            }
+            if (query == qRequisites) store->computeFSClosure(args, paths, false, includeOutputs);
+            else if (query == qReferrersClosure) store->computeFSClosure(args, paths, true);
+            else
+                for (auto & j : args) {
+                    if (query == qReferences) {
                         for (auto & p : store->queryPathInfo(j)->references)
                             paths.insert(p);
                     }
                     else if (query == qReferrers) store->queryReferrers(j, paths);
-                    else if (query == qReferrersClosure) store->computeFSClosure(j, paths, true);
                 }
-            }
             Paths sorted = store->topoSortPaths(paths);
             for (Paths::reverse_iterator i = sorted.rbegin();
                  i != sorted.rend(); ++i)
@@ -739,13 +741,15 @@ static void opVerify(Strings opFlags, Strings opArgs)
 
     bool checkContents = false;
     bool repair = false;
+    bool resume = false;
 
     for (auto & i : opFlags)
         if (i == "--check-contents") checkContents = true;
         else if (i == "--repair") repair = true;
+        else if (i == "--resume") resume = true;
         else throw UsageError(format("unknown flag ‘%1%’") % i);
 
-    if (store->verifyStore(checkContents, repair)) {
+    if (store->verifyStore(checkContents, repair, resume)) {
         printMsg(lvlError, "warning: not all errors were fixed");
         throw Exit(1);
     }
@@ -954,8 +958,7 @@ static void opServe(Strings opFlags, Strings opArgs)
                 bool includeOutputs = readInt(in);
                 PathSet paths = readStorePaths<PathSet>(in);
                 PathSet closure;
-                for (auto & i : paths)
-                    store->computeFSClosure(i, closure, false, includeOutputs);
+                store->computeFSClosure(paths, closure, false, includeOutputs);
                 out << closure;
                 break;
             }
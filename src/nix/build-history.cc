@@ -0,0 +1,109 @@
+#include "command.hh"
+#include "shared.hh"
+#include "build-history.hh"
+
+#include <iomanip>
+#include <algorithm>
+
+using namespace nix;
+
+struct CmdBuildHistory : Command
+{
+    bool showBuilds = false;
+    Strings names;
+
+    CmdBuildHistory()
+    {
+        mkFlag('l', "builds", "show each recorded build rather than a summary", &showBuilds);
+        expectArgs("names", &names);
+    }
+
+    std::string name() override
+    {
+        return "build-history";
+    }
+
+    std::string description() override
+    {
+        return "show the time and resources used by past builds";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show how long builds of GCC took on this machine:",
+                "nix build-history -l gcc"
+            },
+            Example{
+                "To show the derivations that took longest to build:",
+                "nix build-history | sort -nk4"
+            },
+        };
+    }
+
+    static std::string showSeconds(double secs)
+    {
+        return (format("%.1fs") % secs).str();
+    }
+
+    static std::string showMiB(uint64_t bytes)
+    {
+        return (format("%.1fMiB") % (bytes / (1024.0 * 1024.0))).str();
+    }
+
+    void run() override
+    {
+        auto history = getBuildHistory();
+
+        std::vector<BuildRecord> builds;
+        if (names.empty())
+            builds = history->queryBuilds("");
+        else
+            for (auto & name : names) {
+                auto res = history->queryBuilds(name);
+                builds.insert(builds.end(), res.begin(), res.end());
+            }
+
+        if (showBuilds) {
+            for (auto & build : builds)
+                std::cout << format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n")
+                    % build.drvPath
+                    % (build.success ? "succeeded" : "failed")
+                    % showSeconds(build.stopTime - build.startTime)
+                    % showSeconds(build.cpuUser / 1e6)
+                    % showSeconds(build.cpuSystem / 1e6)
+                    % showMiB(build.peakRSS);
+            return;
+        }
+
+        struct Summary
+        {
+            unsigned int builds = 0, failures = 0;
+            double wall = 0, cpu = 0;
+            uint64_t peakRSS = 0;
+        };
+
+        std::map<std::string, Summary> summaries;
+
+        for (auto & build : builds) {
+            auto & summary(summaries[build.name]);
+            summary.builds++;
+            if (!build.success) summary.failures++;
+            summary.wall += build.stopTime - build.startTime;
+            summary.cpu += (build.cpuUser + build.cpuSystem) / 1e6;
+            summary.peakRSS = std::max(summary.peakRSS, build.peakRSS);
+        }
+
+        for (auto & i : summaries)
+            std::cout << format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n")
+                % i.first
+                % i.second.builds
+                % i.second.failures
+                % showSeconds(i.second.wall / i.second.builds)
+                % showSeconds(i.second.cpu / i.second.builds)
+                % showMiB(i.second.peakRSS);
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdBuildHistory>());
@@ -50,6 +50,10 @@ struct CmdCopy : StorePathsCommand
 
         logger->setExpected(copiedLabel, storePaths.size());
 
+        /* Determine in one batch which paths the destination already
+           has. */
+        PathSet valid = dstStore->queryValidPaths(PathSet(storePaths.begin(), storePaths.end()));
+
         ThreadPool pool;
 
         processGraph<Path>(pool,
@@ -62,7 +66,7 @@ struct CmdCopy : StorePathsCommand
             [&](const Path & storePath) {
                 checkInterrupt();
 
-                if (!dstStore->isValidPath(storePath)) {
+                if (!valid.count(storePath)) {
                     Activity act(*logger, lvlInfo, format("copying ‘%s’...") % storePath);
 
                     copyStorePath(srcStore, dstStore, storePath);
@@ -64,8 +64,8 @@ struct CmdPathInfo : StorePathsCommand
                 size_t totalSize = 0;
                 PathSet closure;
                 store->computeFSClosure(storePath, closure, false, false);
-                for (auto & p : closure)
-                    totalSize += store->queryPathInfo(p)->narSize;
+                for (auto & p : store->queryPathInfos(closure))
+                    totalSize += p.second->narSize;
                 std::cout << '\t' << std::setw(11) << totalSize;
             }
 
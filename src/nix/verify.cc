@@ -1,4 +1,5 @@
 #include "command.hh"
+#include "globals.hh"
 #include "shared.hh"
 #include "store-api.hh"
 #include "sync.hh"
@@ -14,6 +15,7 @@ struct CmdVerify : StorePathsCommand
     bool noTrust = false;
     Strings substituterUris;
     size_t sigsNeeded;
+    size_t jobs = 0;
 
     CmdVerify()
     {
@@ -22,6 +24,7 @@ struct CmdVerify : StorePathsCommand
         mkFlag('s', "substituter", {"store-uri"}, "use signatures from specified store", 1,
             [&](Strings ss) { substituterUris.push_back(ss.front()); });
         mkIntFlag('n', "sigs-needed", "require that each path has at least N valid signatures", &sigsNeeded);
+        mkIntFlag('j', "jobs", "verify N paths in parallel (default: the number of cores)", &jobs);
     }
 
     std::string name() override
@@ -67,7 +70,9 @@ struct CmdVerify : StorePathsCommand
         std::string failedLabel("failed");
         logger->setExpected(doneLabel, storePaths.size());
 
-        ThreadPool pool;
+        RateLimiter limiter(std::max(0, settings.get("verify-rate-limit", 0)));
+
+        ThreadPool pool(jobs);
 
         auto doPath = [&](const Path & storePath) {
             try {
@@ -79,10 +84,11 @@ struct CmdVerify : StorePathsCommand
 
                 if (!noContents) {
 
-                    HashSink sink(info->narHash.type);
+                    HashSink hashSink(info->narHash.type);
+                    RateLimitedSink sink(hashSink, limiter);
                     store->narFromPath(info->path, sink);
 
-                    auto hash = sink.finish();
+                    auto hash = hashSink.finish();
 
                     if (hash.first != info->narHash) {
                         logger->incProgress(corruptedLabel);
@@ -0,0 +1,53 @@
+source common.sh
+
+clearStore
+
+# In threaded mode, the daemon answers queries itself and hands the
+# connection over to a new process for anything else.
+startDaemon --option daemon-use-threads true --debug 2> $TEST_ROOT/daemon.log
+
+nrHandOffs() {
+    grep -c "handing over the connection to a new process" $TEST_ROOT/daemon.log || true
+}
+
+# Builds are handed over.
+outPath=$(nix-build dependencies.nix --no-out-link)
+[ $(nrHandOffs) -gt 0 ]
+
+# Queries are answered in the thread.
+n=$(nrHandOffs)
+NIX_REMOTE= nix-store -qR $outPath > $TEST_ROOT/closure-direct
+nix-store -qR $outPath > $TEST_ROOT/closure
+cmp $TEST_ROOT/closure-direct $TEST_ROOT/closure
+nix-store --verify-path $(nix-store -qR $outPath)
+[ $(nrHandOffs) = $n ]
+
+# Imports are handed over together with any of the imported data
+# that the daemon has already read from the client.
+nix-store --export $(nix-store -qR $outPath) > $TEST_ROOT/exp_all
+nix-store --delete $outPath
+n=$(nrHandOffs)
+nix-store --import < $TEST_ROOT/exp_all
+[ $(nrHandOffs) -gt $n ]
+nix-store --verify-path $(nix-store -qR $outPath)
+
+# Multiplexed connections are handed over as well.
+paths="$(nix-store -qR $outPath) $(nix-store -qR $(nix-store -qd $outPath))"
+nrPaths=$(echo $paths | wc -w)
+timeout 60 nix verify --debug -j 4 --no-trust $paths 2> $TEST_ROOT/verify.log
+grep -q "^$nrPaths paths checked, 0 untrusted, 0 corrupted, 0 failed" $TEST_ROOT/verify.log
+grep -q "opening a multiplexed connection to the daemon" $TEST_ROOT/verify.log
+
+# Concurrent clients get the same answers as direct queries.
+NIX_REMOTE= nix-store -qR $paths | sort > $TEST_ROOT/closure-direct
+pids=
+for i in 1 2 3 4; do
+    nix-store -qR $paths | sort > $TEST_ROOT/closure-$i &
+    pids="$pids $!"
+done
+wait $pids
+for i in 1 2 3 4; do
+    cmp $TEST_ROOT/closure-direct $TEST_ROOT/closure-$i
+done
+
+killDaemon
@@ -32,6 +32,39 @@ cat $outPath/input-2/bar
 # Check that the derivation has been GC'd.
 if test -e $drvPath; then false; fi
 
+# Collect garbage in batches of one path, releasing the GC lock in
+# between.  Dead paths that get rooted after the collector has
+# determined the candidates for deletion must survive.  The roots are
+# re-read before every batch, so lots of (ignored) files in the roots
+# directory give us time to add roots while the collector is running.
+for i in $(seq 1 200); do echo $i > $TEST_ROOT/dead-$i; done
+dead=$(nix-store --add $TEST_ROOT/dead-*)
+mkdir "$NIX_STATE_DIR"/gcroots/junk
+(cd "$NIX_STATE_DIR"/gcroots/junk && seq 1 20000 | xargs touch)
+nix-collect-garbage --option gc-batch-size 1 > /dev/null 2> $TEST_ROOT/gc.log &
+pid=$!
+while kill -0 $pid 2> /dev/null && ! grep -q "dead paths (before re-checking)" $TEST_ROOT/gc.log; do
+    sleep 0.1
+done
+rooted=
+for p in $dead; do
+    if nix-store -r --add-root "$NIX_STATE_DIR"/gcroots/late-$(basename $p) $p > /dev/null 2>&1; then
+        rooted="$rooted $p"
+    fi
+done
+wait $pid
+grep -q "dead paths (before re-checking)" $TEST_ROOT/gc.log
+# Some paths must have been rooted in time, otherwise the test is vacuous.
+[ -n "$rooted" ]
+for p in $rooted; do test -e $p; done
+cat $outPath/foobar
+cat $outPath/input-2/bar
+
+# Once the roots are gone, so are the paths.
+rm -rf "$NIX_STATE_DIR"/gcroots/late-* "$NIX_STATE_DIR"/gcroots/junk
+nix-collect-garbage --option gc-batch-size 1
+for p in $dead; do if test -e $p; then false; fi; done
+
 rm "$NIX_STATE_DIR"/gcroots/foo
 
 nix-collect-garbage
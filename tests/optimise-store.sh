@@ -35,6 +35,23 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# A second run only looks at paths that haven't been optimised yet.
+outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+nix-store --optimise -vv 2> $TEST_ROOT/optimise.log
+
+if grep -q "hashing files in ‘$outPath1’" $TEST_ROOT/optimise.log; then
+    echo "optimised path was looked at again"
+    exit 1
+fi
+grep -q "hashing files in ‘$outPath4’" $TEST_ROOT/optimise.log
+
+inode4="$(perl -e "print ((lstat('$outPath4/foo'))[1])")"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
@@ -12,4 +12,33 @@ cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
 nix-store --gc --max-freed 1K
 
+# Importing through the daemon streams the NARs to it.
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix-store --export $(nix-store -qR $outPath) > $TEST_ROOT/exp_all
+nix-store --delete $outPath
+nix-store --import < $TEST_ROOT/exp_all
+nix-store --verify-path $(nix-store -qR $outPath)
+
+# ‘nix verify’ queries the daemon from several threads.  The threads
+# start at the same time, so while the first one is opening a
+# connection, the others must send their queries over a multiplexed
+# connection rather than opening connections of their own.
+paths="$(nix-store -qR $outPath) $(nix-store -qR $(nix-store -qd $outPath))"
+nrPaths=$(echo $paths | wc -w)
+timeout 60 nix verify --debug -j 4 --no-trust $paths 2> $TEST_ROOT/verify.log
+grep -q "^$nrPaths paths checked, 0 untrusted, 0 corrupted, 0 failed" $TEST_ROOT/verify.log
+grep -q "opening a multiplexed connection to the daemon" $TEST_ROOT/verify.log
+
+# Concurrent clients get the same answers as direct queries.
+NIX_REMOTE= nix-store -qR $paths | sort > $TEST_ROOT/closure-direct
+pids=
+for i in 1 2 3 4; do
+    nix-store -qR $paths | sort > $TEST_ROOT/closure-$i &
+    pids="$pids $!"
+done
+wait $pids
+for i in 1 2 3 4; do
+    cmp $TEST_ROOT/closure-direct $TEST_ROOT/closure-$i
+done
+
 killDaemon
@@ -0,0 +1,47 @@
+source common.sh
+
+clearStore
+
+# Add lots of small paths, so that a rate-limited check takes a while
+# but the first paths are done quickly, however many threads check
+# them in parallel.
+for i in $(seq 1 200); do
+    seq 1 1000 | sed "s/^/$i /" > $TEST_ROOT/data-$i
+done
+nrPaths=$(nix-store --add $TEST_ROOT/data-* | wc -l)
+
+checkpoint=$NIX_STATE_DIR/verify-checkpoint
+
+# Start a slow check of the store contents, and interrupt it once some
+# paths have been checked.
+interruptCheck() {
+    nix-store --verify --check-contents --option verify-rate-limit 100000 "$@" 2> /dev/null &
+    pid=$!
+    while [ ! -s $checkpoint ]; do
+        if ! kill -0 $pid 2> /dev/null; then
+            echo "nix-store --verify exited before checking any path" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+    kill -INT $pid
+    if wait $pid; then
+        echo "nix-store --verify succeeded unexpectedly" >&2
+        exit 1
+    fi
+    [ $(wc -l < $checkpoint) -lt $nrPaths ]
+}
+
+# The paths checked so far are recorded, but not used unless we ask for
+# it.
+interruptCheck
+nix-store --verify --check-contents 2> $TEST_ROOT/verify.log
+if grep -q "resuming previous check" $TEST_ROOT/verify.log; then false; fi
+[ ! -e $checkpoint ]
+
+# Resuming an interrupted check skips the paths checked before.
+interruptCheck
+nrChecked=$(wc -l < $checkpoint)
+nix-store --verify --check-contents --resume 2> $TEST_ROOT/verify.log
+grep -q "resuming previous check; skipping $nrChecked paths" $TEST_ROOT/verify.log
+[ ! -e $checkpoint ]